@@ -1,13 +1,21 @@
 /*
- *  common.h
+ *  common.c
  *
- *  All the common typedefs, declarations, includes clubbed under the same
- *  header file
+ *  Definitions of the common declarations in common.h
  *
  *  Author: rp <rp@meetrp.com>
  *
  */
 
+#define _POSIX_C_SOURCE 200112L /* clock_gettime() with --std=c99 */
+
+/* system includes */
+#include <time.h>               /* clock_gettime */
+#include <sys/time.h>           /* gettimeofday */
+
+/* our includes */
+#include "common.h"
+
 const char* _mq_err_str[] = {
     "Generic error",
     "Success",
@@ -20,7 +28,7 @@ const char* _mq_err_str[] = {
     "Mongo DB queue name provided is too long",
     "Mongo DB name space validation failed",
     "Mongo DB insert failed",
-    "Mongo DB IO error while reading or writting on a socket"
+    "Mongo DB IO error while reading or writting on a socket",
     "Mongo DB run command failed",
     "Mongo DB general socket error",
     "Mongo DB response is not the expected len",
@@ -28,6 +36,8 @@ const char* _mq_err_str[] = {
     "Mongo DB BSON invalid for the given op",
     "Mongo DB BSON not finished",
     "Mongo DB BSON too large & exceeds max BSON size",
+    "Mongo DB message id is not valid",
+    "Mongo DB message is not leased with the given id",
 
     "Libevent base initialization failed",
     "Libevent creation of httpd server failed",
@@ -42,3 +52,71 @@ const char* _mq_err_str[] = {
     "Thread unable to create a phthread"
 };
 
+
+/**
+ * mono_ms()
+ *
+ * Monotonic clock in milli seconds
+ *
+ **/
+uint64_t
+mono_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+
+/**
+ * now_usecs()
+ *
+ * Monotonic clock in micro seconds
+ *
+ **/
+uint64_t
+now_usecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+
+/**
+ * now_ms()
+ *
+ * Wall clock in milli seconds, as stored in mongo db, e.g., 'visible_at'
+ *
+ **/
+int64_t
+now_ms(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return ((int64_t)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+}
+
+
+/**
+ * djb2_hash()
+ *
+ * djb2 hash of the string
+ *
+ *  str        - '\0' terminated string
+ *
+ **/
+unsigned int
+djb2_hash(const char *str)
+{
+    unsigned int hash = 5381;
+    int c;
+
+    while ((c = *str++))
+        hash = ((hash << 5) + hash) + c;
+
+    return hash;
+}
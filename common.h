@@ -11,6 +11,8 @@
 #ifndef _COMMON_H_
 #define _COMMON_H_
 
+#include <stdint.h>             /* uint64_t, int64_t */
+
 /* the missing piece of definition in C */
 typedef enum _bool_t {
     false = 0,
@@ -39,6 +41,8 @@ typedef enum _mq_err_t {
     MQ_DB_BSON_INVALID,         /* BSON invalid for the given op */
     MQ_DB_BSON_NOT_FINISHED,    /* BSON obj has not been finished */
     MQ_DB_BSON_TOO_LARGE,       /* BSON obj exceeds max BSON size */
+    MQ_DB_MSG_ID_INVALID,       /* message id to ack is not valid */
+    MQ_DB_MSG_NOT_LEASED,       /* message to ack is not leased by the id */
 
     MQ_EV_INIT_FAILED,                  /* event initialization failed */
     MQ_EV_CREATE_HTTP_SERVER_FAILED,    /* creation of httpd server failed */
@@ -54,10 +58,17 @@ typedef enum _mq_err_t {
     /* Remember to update the _mq_err_str defined below  */
 } mq_err_t;
 
-const char** _mq_err_str;
+extern const char* _mq_err_str[];
 #define MQ_ERR_STR(err)     _mq_err_str[err+1]
 
 
+/* Clocks & hashing */
+uint64_t mono_ms(void);
+uint64_t now_usecs(void);
+int64_t now_ms(void);
+unsigned int djb2_hash(const char *str);
+
+
 /* Logging */
 #define LOG_MAX_LEN             1024
 //#define LOG_FILE                "/var/log/mongoq.log"
@@ -19,5 +19,85 @@
 #define MQ_NTHREADS             1
 #define MQ_SERVER_PORT          5454
 #define MQ_CONN_BACKLOG         64      // Max pending connections
+#define MQ_MAX_DATA_LEN         1024    // Max len of a queued value
+
+/* Max len of a queue, topic or group name. The mongo db name space of its
+ * longest collection, <db>.<name>.topic, has to stay below the 64 chars
+ * mdb.c allows with the db name above; so do <name>.p<#> & <name>.dead
+ */
+#define MQ_MAX_QNAME_LEN        40
+
+/* HTTP connections are kept alive upto the idle timeout; requests with
+ * larger headers or body are rejected by evhttp itself
+ */
+#define MQ_HTTP_TIMEOUT_SECS    30      // idle keep-alive timeout
+#define MQ_HTTP_MAX_HEADERS_LEN 8192
+#define MQ_HTTP_MAX_BODY_LEN    MQ_MAX_DATA_LEN
+#define MQ_TCP_DEFER_ACCEPT_SECS 5      // accept only once data arrives
+
+/* Batch pops, 'GET /q/<q>?count=<n>', are streamed as a chunked reply, a
+ * chunk of upto MQ_BATCH_SLICE messages per event loop iteration
+ */
+#define MQ_MAX_BATCH            1000
+#define MQ_BATCH_SLICE          32
+
+/* Queue partitioning: a logical queue <q> is spread across the physical
+ * collections <q>.p0 .. <q>.p(N-1). Setting this to 1 disables it and
+ * <q> maps to a single collection.
+ */
+#define MQ_QUEUE_PARTITIONS     4
+
+/* Request tracing: requests slower than the threshold are kept, with their
+ * stage breakdown, in a ring of the given size & dumped by GET /admin/slowlog
+ */
+#define MQ_SLOW_LOG_THRESHOLD_MS    100
+#define MQ_SLOW_LOG_SIZE            128
+
+/* Delayed delivery & long polling: 'POST /q/<q>?delay=<ms>' & 'GET
+ * /q/<q>?wait=<ms>'. Due times & waiter timeouts are kept in a per worker
+ * timer wheel of the given resolution.
+ */
+#define MQ_MAX_DELAY_MS         (7 * 24 * 3600 * 1000)  // a week
+#define MQ_MAX_WAIT_MS          (60 * 1000)             // a minute
+#define MQ_TIMER_TICK_MS        10
+
+/* At least once delivery: 'GET /q/<q>?lease=<ms>' hides the message until
+ * it is acked by 'DELETE /q/<q>?id=<id>'. A message leased more than its
+ * max deliveries ('POST /q/<q>?max_deliveries=<n>') is a dead letter &
+ * every MQ_DEAD_SWEEP_MS is moved, MQ_DEAD_BATCH at a time, to <q>.dead.
+ * A replay ('POST /dead/<q>') claims its dead letters first; a claim older
+ * than MQ_DEAD_CLAIM_MS is of a replay that failed midway & is taken over.
+ */
+#define MQ_MAX_LEASE_MS         (3600 * 1000)           // an hour
+#define MQ_MAX_DELIVERIES       5                       // default
+#define MQ_MAX_DELIVERIES_LIMIT 1000
+#define MQ_DEAD_SWEEP_MS        5000
+#define MQ_DEAD_BATCH           100
+#define MQ_DEAD_MAX_QUEUES      64      // leased queues swept per worker
+#define MQ_DEAD_CLAIM_MS        (60 * 1000)             // a minute
+
+/* Topics: 'POST /t/<t>' stores a message once & 'GET /t/<t>?group=<g>'
+ * pops it for each consumer group, whose offset is kept in mongo db. A pop
+ * does not skip a gap in the seq #s, i.e., a push still in flight, till
+ * MQ_TOPIC_GAP_MS. Every MQ_TOPIC_COMPACT_MS the messages consumed by all
+ * the groups are removed.
+ */
+#define MQ_TOPIC_GAP_MS         1000
+#define MQ_TOPIC_POP_RETRIES    3       // when racing with the same group
+#define MQ_TOPIC_COMPACT_MS     5000
+#define MQ_TOPIC_MAX_TOPICS     64      // topics compacted per worker
+
+/* Duplicate suppression: a push with 'POST /q/<q>?dedup=<key>' is dropped
+ * if a push into <q> with the same key was done in the last
+ * MQ_DEDUP_TTL_SECS. The keys are kept in mongo db & the recently used
+ * ones cached in memory, in shards of MQ_DEDUP_CACHE_SIZE /
+ * MQ_DEDUP_SHARDS; both have to be powers of 2. A push whose key is still
+ * being pushed by another request gets a 503, to be retried; after
+ * MQ_DEDUP_PENDING_MS that other push is taken to have died.
+ */
+#define MQ_DEDUP_TTL_SECS       300
+#define MQ_DEDUP_PENDING_MS     5000
+#define MQ_DEDUP_CACHE_SIZE     16384
+#define MQ_DEDUP_SHARDS         16
 
 #endif /* _CONFIG_H_ */
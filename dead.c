@@ -0,0 +1,64 @@
+/*
+ *  dead.c
+ *
+ *  Dead letters. Each worker remembers the queues it has leased messages
+ *  from & periodically sweeps the ones that ran out of deliveries into the
+ *  queue's dead letter queue, so that poison messages stop being delivered.
+ *
+ *  Author: rp <rp@meetrp.com>
+ *
+ */
+
+/* our includes */
+#include "common.h"
+#include "config.h"
+#include "mongoq.h"
+
+
+/**
+ * dead_init()
+ *
+ * Set up the dead letter sweeper of the worker
+ *
+ *  evt        - worker
+ *  ev_base    - event base of the worker
+ *
+ **/
+mq_err_t
+dead_init(ev_thread_t *evt, struct event_base *ev_base)
+{
+    return track_init(&evt->evt_dead, evt, ev_base, MQ_DEAD_SWEEP_MS,
+                      MQ_DEAD_MAX_QUEUES, part_sweep, "dead letter sweep");
+}
+
+
+/**
+ * dead_free()
+ *
+ * Tear down the dead letter sweeper of the worker
+ *
+ *  evt        - worker
+ *
+ **/
+void
+dead_free(ev_thread_t *evt)
+{
+    track_free(evt->evt_dead);
+    evt->evt_dead = NULL;
+}
+
+
+/**
+ * dead_track()
+ *
+ * Remember 'qname' to be swept, as a message has been leased from it
+ *
+ *  evt        - worker
+ *  qname      - name of the queue
+ *
+ **/
+void
+dead_track(ev_thread_t *evt, const char *qname)
+{
+    track_add(evt->evt_dead, qname);
+}
@@ -0,0 +1,375 @@
+/*
+ *  dedup.c
+ *
+ *  Duplicate suppression of pushes with an idempotency key. The keys seen
+ *  in the last MQ_DEDUP_TTL_SECS are remembered in mongo db, which is the
+ *  source of truth, first as pending & then as done once pushed. Only the
+ *  keys that are done are cached in memory, so that a retried push is
+ *  usually suppressed without a round trip. The cache is shared by all the
+ *  workers & is split into shards, each with its own lock, hash table &
+ *  LRU list.
+ *
+ *  Author: rp <rp@meetrp.com>
+ *
+ */
+
+/* system includes */
+#include <stdio.h>              /* snprintf */
+#include <string.h>             /* strcmp, strcpy */
+#include <pthread.h>            /* pthread_mutex_* */
+
+/* our includes */
+#include "common.h"
+#include "config.h"
+#include "mongoq.h"
+
+
+/* locally used */
+#define DEDUP_SHARD_SIZE    (MQ_DEDUP_CACHE_SIZE / MQ_DEDUP_SHARDS)
+#define DEDUP_BUCKETS       DEDUP_SHARD_SIZE    /* a power of 2 */
+
+typedef struct _dd_entry_t {
+    struct _dd_entry_t *de_next;        /* next in the hash bucket */
+    struct _dd_entry_t *de_lru_prev;    /* more recently used */
+    struct _dd_entry_t *de_lru_next;    /* less recently used */
+    uint64_t de_hash;
+    uint64_t de_expires;                /* monotonic, in milli secs */
+    char de_id[MQ_DEDUP_ID_LEN];
+} dd_entry_t;
+
+typedef struct _dd_shard_t {
+    pthread_mutex_t ds_lock;
+    dd_entry_t *ds_buckets[DEDUP_BUCKETS];
+    dd_entry_t *ds_lru_head;            /* most recently used */
+    dd_entry_t *ds_lru_tail;            /* evicted first */
+    dd_entry_t *ds_free;                /* expired entries, for reuse */
+    int ds_used;                        /* entries ever handed out */
+    dd_entry_t ds_entries[DEDUP_SHARD_SIZE];
+} dd_shard_t;
+
+static dd_shard_t shards[MQ_DEDUP_SHARDS];
+
+
+/**
+ * dedup_hash()
+ *
+ * 64 bit FNV-1a hash of the id; the low bits pick the shard & the higher
+ * ones the bucket within it
+ *
+ *  id         - '\0' terminated id
+ *
+ **/
+static uint64_t
+dedup_hash(const char *id)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    while (*id) {
+        hash ^= (unsigned char) *id++;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+
+/**
+ * lru_unlink()
+ *
+ * Take the entry off the LRU list of the shard
+ *
+ *  ds         - shard
+ *  de         - entry
+ *
+ **/
+static void
+lru_unlink(dd_shard_t *ds, dd_entry_t *de)
+{
+    if (NULL != de->de_lru_prev)
+        de->de_lru_prev->de_lru_next = de->de_lru_next;
+    else
+        ds->ds_lru_head = de->de_lru_next;
+
+    if (NULL != de->de_lru_next)
+        de->de_lru_next->de_lru_prev = de->de_lru_prev;
+    else
+        ds->ds_lru_tail = de->de_lru_prev;
+}
+
+
+/**
+ * lru_push()
+ *
+ * Put the entry at the head, i.e., the most recently used end, of the LRU
+ * list of the shard
+ *
+ *  ds         - shard
+ *  de         - entry
+ *
+ **/
+static void
+lru_push(dd_shard_t *ds, dd_entry_t *de)
+{
+    de->de_lru_prev = NULL;
+    de->de_lru_next = ds->ds_lru_head;
+    if (NULL != ds->ds_lru_head)
+        ds->ds_lru_head->de_lru_prev = de;
+    else
+        ds->ds_lru_tail = de;
+    ds->ds_lru_head = de;
+}
+
+
+/**
+ * entry_remove()
+ *
+ * Take the entry out of the hash table & the LRU list of the shard
+ *
+ *  ds         - shard
+ *  de         - entry
+ *
+ **/
+static void
+entry_remove(dd_shard_t *ds, dd_entry_t *de)
+{
+    dd_entry_t **pp = &ds->ds_buckets[(de->de_hash >> 8) &
+                                      (DEDUP_BUCKETS - 1)];
+
+    for (; NULL != *pp; pp = &(*pp)->de_next) {
+        if (*pp == de) {
+            *pp = de->de_next;
+            break;
+        }
+    }
+    lru_unlink(ds, de);
+}
+
+
+/**
+ * dedup_init()
+ *
+ * Initialize the shards of the in-memory cache; to be called before any
+ * worker is started
+ *
+ **/
+mq_err_t
+dedup_init(void)
+{
+    int i = 0;
+
+    memset(shards, 0, sizeof(shards));
+    for (; i < MQ_DEDUP_SHARDS; i++) {
+        if (0 != pthread_mutex_init(&shards[i].ds_lock, NULL)) {
+            mqerr("unable to initialize the lock of dedup shard #%d", i);
+            return MQ_ERR;
+        }
+    }
+
+    return MQ_OK;
+}
+
+
+/**
+ * dedup_seen()
+ *
+ * Look the id up in the in-memory cache. An expired entry is dropped; a
+ * live one is moved to the head of the LRU list.
+ *
+ *  id         - <qname>.<idempotency key>
+ *
+ **/
+static bool
+dedup_seen(const char *id)
+{
+    uint64_t hash = dedup_hash(id);
+    dd_shard_t *ds = &shards[hash % MQ_DEDUP_SHARDS];
+    dd_entry_t *de = NULL;
+    bool seen = false;
+
+    pthread_mutex_lock(&ds->ds_lock);
+    de = ds->ds_buckets[(hash >> 8) & (DEDUP_BUCKETS - 1)];
+    for (; NULL != de; de = de->de_next)
+        if (de->de_hash == hash && 0 == strcmp(de->de_id, id))
+            break;
+
+    if (NULL != de) {
+        if (de->de_expires <= mono_ms()) {
+            entry_remove(ds, de);
+            de->de_next = ds->ds_free;
+            ds->ds_free = de;
+        } else {
+            lru_unlink(ds, de);
+            lru_push(ds, de);
+            seen = true;
+        }
+    }
+    pthread_mutex_unlock(&ds->ds_lock);
+
+    return seen;
+}
+
+
+/**
+ * dedup_remember()
+ *
+ * Add the id to the in-memory cache till its key expires in mongo db,
+ * MQ_DEDUP_TTL_SECS after 'at', evicting the least recently used entry of
+ * the shard if it is full. A key that has expired already is not added.
+ *
+ *  id         - <qname>.<idempotency key>
+ *  at         - time the key was done, in milli secs since the epoch
+ *
+ **/
+static void
+dedup_remember(const char *id, int64_t at)
+{
+    uint64_t hash = dedup_hash(id);
+    dd_shard_t *ds = &shards[hash % MQ_DEDUP_SHARDS];
+    dd_entry_t **bucket = &ds->ds_buckets[(hash >> 8) & (DEDUP_BUCKETS - 1)];
+    dd_entry_t *de = NULL;
+    int64_t left = at + (int64_t) MQ_DEDUP_TTL_SECS * 1000 - now_ms();
+
+    if (left <= 0)
+        return;
+
+    pthread_mutex_lock(&ds->ds_lock);
+    for (de = *bucket; NULL != de; de = de->de_next)
+        if (de->de_hash == hash && 0 == strcmp(de->de_id, id))
+            break;
+
+    if (NULL != de) {
+        /* remembered by another worker in the meantime */
+        lru_unlink(ds, de);
+    } else {
+        if (NULL != ds->ds_free) {
+            de = ds->ds_free;
+            ds->ds_free = de->de_next;
+        } else if (ds->ds_used < DEDUP_SHARD_SIZE) {
+            de = &ds->ds_entries[ds->ds_used++];
+        } else {
+            de = ds->ds_lru_tail;
+            entry_remove(ds, de);
+        }
+
+        de->de_hash = hash;
+        strcpy(de->de_id, id);
+        de->de_next = *bucket;
+        *bucket = de;
+    }
+
+    de->de_expires = mono_ms() + (uint64_t) left;
+    lru_push(ds, de);
+    pthread_mutex_unlock(&ds->ds_lock);
+}
+
+
+/**
+ * dedup_id()
+ *
+ * Build the id, <qname>.<key>, under which the key of the queue is
+ * remembered
+ *
+ *  qname      - name of the queue
+ *  key        - idempotency key
+ *  id         - id is returned here; MQ_DEDUP_ID_LEN long
+ *
+ **/
+static mq_err_t
+dedup_id(const char *qname, const char *key, char *id)
+{
+    int len = snprintf(id, MQ_DEDUP_ID_LEN, "%s.%s", qname, key);
+
+    if (len < 0 || MQ_DEDUP_ID_LEN <= len) {
+        mqerr("idempotency key is too long: %s", key);
+        return MQ_DB_QNAME_TOO_LONG;
+    }
+
+    return MQ_OK;
+}
+
+
+/**
+ * dedup_begin()
+ *
+ * Claim the idempotency key 'key' for a push into 'qname'. Only a new
+ * claim is to be pushed, & followed by dedup_end(); the push of a key that
+ * is done is a duplicate & that of a pending one is to be retried later.
+ *
+ *  conn       - mongo db connection object
+ *  qname      - name of the queue
+ *  key        - idempotency key
+ *  claim      - outcome of the claim is returned here
+ *  at         - time of the claim, for dedup_end(), is returned here
+ *  tr         - trace of the request (can be NULL)
+ *
+ **/
+mq_err_t
+dedup_begin(mongo *conn, const char *qname, const char *key,
+            mq_claim_t *claim, int64_t *at, mq_trace_t *tr)
+{
+    mq_err_t ret_code = MQ_ERR;
+    char id[MQ_DEDUP_ID_LEN];
+
+    *claim = MQ_CLAIM_PENDING;
+    ret_code = dedup_id(qname, key, id);
+    if (MQ_OK != ret_code)
+        return ret_code;
+
+    if (dedup_seen(id)) {
+        mqdbg("duplicate push into %s: %s (cached)", qname, key);
+        *claim = MQ_CLAIM_DONE;
+        return MQ_OK;
+    }
+
+    ret_code = db_dedup_claim(conn, id, claim, at, tr);
+    if (MQ_OK != ret_code)
+        return ret_code;
+
+    if (MQ_CLAIM_DONE == *claim) {
+        mqdbg("duplicate push into %s: %s", qname, key);
+        dedup_remember(id, *at);
+    } else if (MQ_CLAIM_PENDING == *claim) {
+        mqdbg("push into %s: %s is in progress", qname, key);
+    }
+
+    return MQ_OK;
+}
+
+
+/**
+ * dedup_end()
+ *
+ * Finish a push claimed by dedup_begin(). The key of a push that went
+ * through is marked as done & cached; that of a failed push is released
+ * so that its retry is not suppressed.
+ *
+ *  conn       - mongo db connection object
+ *  qname      - name of the queue
+ *  key        - idempotency key
+ *  at         - time of the claim, as returned by dedup_begin()
+ *  pushed     - whether the push went through
+ *  tr         - trace of the request (can be NULL)
+ *
+ **/
+void
+dedup_end(mongo *conn, const char *qname, const char *key, int64_t at,
+          bool pushed, mq_trace_t *tr)
+{
+    mq_err_t ret_code = MQ_ERR;
+    char id[MQ_DEDUP_ID_LEN];
+
+    if (MQ_OK != dedup_id(qname, key, id))
+        return;
+
+    if (pushed) {
+        ret_code = db_dedup_done(conn, id, at, tr);
+        if (MQ_OK != ret_code)
+            mqerr("done of %s failed: %s", id, MQ_ERR_STR(ret_code));
+        dedup_remember(id, now_ms());
+        return;
+    }
+
+    ret_code = db_dedup_release(conn, id, at, tr);
+    if (MQ_OK != ret_code)
+        mqerr("release of %s failed: %s", id, MQ_ERR_STR(ret_code));
+}
@@ -7,10 +7,12 @@
  *
  */
 
+#define _POSIX_C_SOURCE 200112L /* ctime_r() with --std=c99 */
+
 /* system includes */
 #include <stdarg.h>             /* va_*() */
 #include <stdio.h>              /* fopen(), FILE, .. */
-#include <time.h>               /* time(), ctime(), .. */
+#include <time.h>               /* time(), ctime_r(), .. */
 #include <string.h>             /* strlen() */
 #include <unistd.h>             /* getpid() */
 #include <pthread.h>            /* pthread_self() */
@@ -37,14 +39,14 @@ void mq_log(const char *log_level, const char *fname, const char *func,
     va_list args;
     char msg[LOG_MAX_LEN];
     time_t timer;
-    char *cur_time_str = NULL;
+    char cur_time_str[32];      /* ctime_r() needs 26; thread safe */
 
     FILE *fstream = fopen(LOG_FILE, "a");
     if (NULL == fstream)
         fstream = stdout;
 
     timer = time(NULL);
-    cur_time_str = ctime(&timer);
+    ctime_r(&timer, cur_time_str);
     cur_time_str[strlen(cur_time_str) - 1] = 0;     /* '/0' terminate */
 
     va_start(args, fmt);
@@ -9,17 +9,31 @@
 
 /* system includes */
 #include <time.h>               /* time */
+#include <stdlib.h>             /* strtoll */
 #include <string.h>             /* strlen */
 #include "mongo.h"
 
 /* our includes */
 #include "common.h"
 #include "config.h"
+#include "mongoq.h"
 
 
 /* locally used */
 #define NAME_SPC_MAX_LEN    64
-#define MAX_DATA_LEN        1024
+
+/* topics: the seq # counters, the offsets of the consumer groups & the
+ * suffix of the collection holding a topic's messages. Queue names can
+ * not have a '.', so these never clash with a queue. */
+#define TOPIC_SEQ_COLL      "mq.topics"
+#define TOPIC_GROUP_COLL    "mq.groups"
+#define TOPIC_COLL_SUFFIX   ".topic"
+
+/* idempotency keys of the pushes, {_id: <qname>.<key>, at: <date>} */
+#define DEDUP_COLL          "mq.dedup"
+#define DEDUP_TTL_INDEX     "at_ttl"
+#define DEDUP_PENDING       "pending"   /* states of an idempotency key */
+#define DEDUP_DONE          "done"
 
 
 /**
@@ -60,9 +74,11 @@ mongo_to_mq(int mongo_err)
  *
  * Initialize the DB, i.e., mongodb
  *
+ *  conn_out   - the connected mongo db connection object is returned here
+ *
  **/
 mq_err_t
-db_init(void)
+db_init(mongo **conn_out)
 {
     mq_err_t ret_code = MQ_ERR;
 
@@ -94,6 +110,7 @@ db_init(void)
         goto failed_to_connect;
     }
 
+    *conn_out = conn;
     ret_code = MQ_OK;
 
 end:
@@ -111,34 +128,31 @@ failed_to_connect:
  *
  * De-initialize the DB, i.e., drop the connection
  *
+ *  conn       - mongo db connection object returned by db_init()
+ *
  **/
 void
-db_deinit(void *args)
+db_deinit(mongo *conn)
 {
-    mongo *conn = (mongo *) args;
     mongo_destroy(conn);
     free(conn);
 }
 
 
 /**
- * db_push()
+ * db_name_spc()
  *
- * Push the 'val' into the queue 'qname'
+ * Build & validate the name space, <db>.<qname>, of the queue 'qname'
  *
  *  conn       - mongo db connection object
- *  qname      - name of the queue into which data is queued
- *  val        - string formatted data to be pushed
+ *  qname      - name of the queue
+ *  name_spc   - name space is returned here; NAME_SPC_MAX_LEN long
  *
  **/
-mq_err_t
-db_push(mongo *conn, const char *qname, const char *val)
+static mq_err_t
+db_name_spc(mongo *conn, const char *qname, char *name_spc)
 {
-    bson b;
     mq_err_t ret_code = MQ_ERR;
-    
-    /* avoided malloc for perfomrance */
-    char name_spc[NAME_SPC_MAX_LEN];
 
     /* limiting the qname with the db name for ease of programming */
     int name_spc_len = (strlen(MONGO_DB_NAME) + strlen(qname) +
@@ -149,7 +163,6 @@ db_push(mongo *conn, const char *qname, const char *val)
         goto end;
     }
     snprintf(name_spc, name_spc_len, "%s.%s", MONGO_DB_NAME, qname);
-    name_spc[name_spc_len + 1] = 0;         /* null termination */
 
 
     /* validate the name space */
@@ -160,19 +173,158 @@ db_push(mongo *conn, const char *qname, const char *val)
     }
     mqdbg("Name space{%s} is valid!", name_spc);
 
+    ret_code = MQ_OK;
+end:
+    return ret_code;
+}
+
+
+/**
+ * append_visible_query()
+ *
+ * Append the query for a message that can be delivered, i.e., is visible
+ * & has not run out of deliveries, to the bson object 'b':
+ *   {visible_at: {$not: {$gt: <now>}}, deliveries_left: {$not: {$lte: 0}}}
+ * '$not' rather than '$lte'/'$gt' so that the documents pushed before these
+ * fields existed are matched as well.
+ *
+ *  b          - bson object being built
+ *
+ **/
+static void
+append_visible_query(bson *b)
+{
+    bson_append_start_object(b, "query");
+        bson_append_start_object(b, "visible_at");
+            bson_append_start_object(b, "$not");
+                bson_append_long(b, "$gt", now_ms());
+            bson_append_finish_object(b);
+        bson_append_finish_object(b);
+        bson_append_start_object(b, "deliveries_left");
+            bson_append_start_object(b, "$not");
+                bson_append_int(b, "$lte", 0);
+            bson_append_finish_object(b);
+        bson_append_finish_object(b);
+    bson_append_finish_object(b);
+}
+
+
+/**
+ * db_msg_decode()
+ *
+ * Decode a message document. Each field is taken only if it is of the
+ * type it is stored as; the ones that are absent or of any other type are
+ * left zeroed.
+ *
+ *  data       - bson data of the document
+ *  msg        - decoded message is returned here; its 'mg_val' points
+ *               into 'data'
+ *
+ **/
+void
+db_msg_decode(const char *data, mq_msg_t *msg)
+{
+    bson_iterator it;
+    bson_type type;
+    const char *key = NULL;
+
+    memset(msg, 0, sizeof(mq_msg_t));
+    bson_iterator_from_buffer(&it, data);
+    while (BSON_EOO != (type = bson_iterator_next(&it))) {
+        key = bson_iterator_key(&it);
+        if (0 == strcmp("val", key)) {
+            if (BSON_STRING == type)
+                msg->mg_val = bson_iterator_string(&it);
+        } else if (0 == strcmp("_id", key)) {
+            if (BSON_OID == type) {
+                msg->mg_oid = *bson_iterator_oid(&it);
+                msg->mg_has_oid = true;
+            } else if (BSON_LONG == type || BSON_INT == type) {
+                msg->mg_seq = bson_iterator_long(&it);
+            }
+        } else if (0 == strcmp("deliveries", key)) {
+            if (BSON_INT == type || BSON_LONG == type)
+                msg->mg_deliveries = bson_iterator_int(&it);
+        } else if (0 == strcmp("max_deliveries", key)) {
+            msg->mg_bounded = true;
+        } else if (0 == strcmp("pushed_at", key)) {
+            if (BSON_LONG == type || BSON_INT == type)
+                msg->mg_pushed_at = bson_iterator_long(&it);
+        }
+    }
+}
+
+
+/**
+ * db_reply_msg()
+ *
+ * Decode the message, 'value', of a findAndModify reply. Returns false if
+ * the reply has none, i.e., nothing matched.
+ *
+ *  out        - reply of the findAndModify
+ *  msg        - decoded message is returned here
+ *
+ **/
+bool
+db_reply_msg(const bson *out, mq_msg_t *msg)
+{
+    bson_iterator it;
+
+    memset(msg, 0, sizeof(mq_msg_t));
+    if (BSON_OBJECT != bson_find(&it, out, "value"))
+        return false;
+
+    db_msg_decode(bson_iterator_value(&it), msg);
+    return true;
+}
+
+
+/**
+ * db_push()
+ *
+ * Push the 'val' into the queue 'qname'
+ *
+ *  conn       - mongo db connection object
+ *  qname      - name of the queue into which data is queued
+ *  val        - string formatted data to be pushed
+ *  delay_ms   - the data is not visible to pops for these many milli secs
+ *  max_deliveries - # of leases after which the data is a dead letter
+ *  tr         - trace of the request (can be NULL)
+ *
+ **/
+mq_err_t
+db_push(mongo *conn, const char *qname, const char *val,
+        unsigned int delay_ms, unsigned int max_deliveries, mq_trace_t *tr)
+{
+    bson b;
+    mq_err_t ret_code = MQ_ERR;
+    
+    /* avoided malloc for perfomrance */
+    char name_spc[NAME_SPC_MAX_LEN];
+
+    ret_code = db_name_spc(conn, qname, name_spc);
+    if (MQ_OK != ret_code)
+        goto end;
+
 
     /* initialize the bson object with val for insertion */
     bson_init(&b);
     bson_append_int(&b, "ts", time(NULL));
+    bson_append_long(&b, "visible_at", now_ms() + delay_ms);
     bson_append_string(&b, "val", val);
+    bson_append_int(&b, "deliveries", 0);
+    bson_append_int(&b, "deliveries_left", max_deliveries);
+    bson_append_int(&b, "max_deliveries", max_deliveries);
     bson_finish(&b);
 
     ret_code = MQ_OK;
     mqdbg("about to insert(%s) into queue(%s)", val, qname);
+    trace_mark(tr, MQ_STAGE_DB_SEND);
     if (MONGO_OK != mongo_insert(conn, name_spc, &b, NULL)) {
         mqerr("failed to insert: %s", val);
         ret_code = mongo_to_mq(conn->err);
     }
+    trace_mark(tr, MQ_STAGE_DB_REPLY);
 
     bson_destroy(&b);
 
@@ -187,34 +339,42 @@ end:
  *
  *  conn       - mongo db connection object
  *  qname      - name of the queue from where data is poped.
- *  val        - string formatted data that is returned. If no data is
- *               found then '\0' is returned.
+ *  val        - string formatted data that is returned; MQ_MAX_DATA_LEN
+ *               long. If no data is found then '\0' is returned.
+ *  tr         - trace of the request (can be NULL)
+ *
+ *  The oldest document (by '_id') that is visible, i.e., whose 'visible_at'
+ *  has passed & which is not a dead letter, is removed & returned, so that
+ *  the queue is FIFO.
  *
  **/
 mq_err_t
-db_pop(mongo *conn, const char *qname, char *val)
+db_pop(mongo *conn, const char *qname, char *val, mq_trace_t *tr)
 {
     int result = -1;
     mq_err_t ret_code = MQ_ERR;
     bson cmd, out;
-    bson_iterator it;
+    mq_msg_t msg;
 
 
     /*
      * push the following command into a bson object:
-     *   <db>.<q>.findAndModify({remove: {$pop: {$val: -1}}})
+     *   <db>.<q>.findAndModify({query: <visible>, sort: {_id: 1},
+     *                           remove: true})
      */
     bson_init(&cmd);
     bson_append_string(&cmd, "findAndModify", qname);
-        bson_append_start_object(&cmd, "remove");
-            bson_append_start_object(&cmd, "$pop");
-                bson_append_int(&cmd, "$val", -1);
-            bson_append_finish_object(&cmd);
+        append_visible_query(&cmd);
+        bson_append_start_object(&cmd, "sort");
+            bson_append_int(&cmd, "_id", 1);
         bson_append_finish_object(&cmd);
+        bson_append_bool(&cmd, "remove", true);
     bson_finish(&cmd);
 
     mqdbg("about to execute the command");
+    trace_mark(tr, MQ_STAGE_DB_SEND);
     result = mongo_run_command(conn, MONGO_DB_NAME, &cmd, &out);
+    trace_mark(tr, MQ_STAGE_DB_REPLY);
     if (MONGO_OK != result) {
         mqerr("run command failed.");
         ret_code = mongo_to_mq(conn->err);
@@ -222,22 +382,1302 @@ db_pop(mongo *conn, const char *qname, char *val)
     }
 
     mqdbg("mongo run command successful");
-    if (bson_find(&it, &out, "value")) {
-        bson_iterator it_sub;
-        bson_iterator_from_buffer(&it_sub, bson_iterator_value(&it));
-        while (bson_iterator_next(&it_sub)) {
-            if (0 == strcmp("val", bson_iterator_key(&it_sub))) {
-                const char *data = bson_iterator_string(&it_sub);
-                snprintf(val, strlen(data) + 1, "%s", data);
-                mqdbg("qname: %s   val: %s", qname, val);
-                ret_code = MQ_OK;
-                break;
-            }
-        }
+    val[0] = '\0';
+    ret_code = MQ_OK;               /* an empty queue is not an error */
+    if (db_reply_msg(&out, &msg) && NULL != msg.mg_val) {
+        snprintf(val, MQ_MAX_DATA_LEN, "%s", msg.mg_val);
+        mqdbg("qname: %s   val: %s", qname, val);
+    }
+    bson_destroy(&out);
+
+end:
+    bson_destroy(&cmd);
+    return ret_code;
+}
+
+
+/**
+ * lease_upgrade()
+ *
+ * Give a message pushed before deliveries were bounded, & just leased by
+ * db_lease(), the default bound, counting the deliveries made so far
+ *
+ *  conn       - mongo db connection object
+ *  qname      - name of the queue the message was leased from
+ *  oid        - id of the message
+ *  deliveries - # of times the message has been leased
+ *
+ **/
+static mq_err_t
+lease_upgrade(mongo *conn, const char *qname, const bson_oid_t *oid,
+              int deliveries)
+{
+    mq_err_t ret_code = MQ_ERR;
+    char name_spc[NAME_SPC_MAX_LEN];
+    bson cond, op;
+
+    ret_code = db_name_spc(conn, qname, name_spc);
+    if (MQ_OK != ret_code)
+        return ret_code;
+
+    /* {_id: <oid>}, {$set: {deliveries_left: .., max_deliveries: ..}} */
+    bson_init(&cond);
+    bson_append_oid(&cond, "_id", oid);
+    bson_finish(&cond);
+
+    bson_init(&op);
+    bson_append_start_object(&op, "$set");
+        bson_append_int(&op, "deliveries_left",
+                        MQ_MAX_DELIVERIES - deliveries);
+        bson_append_int(&op, "max_deliveries", MQ_MAX_DELIVERIES);
+    bson_append_finish_object(&op);
+    bson_finish(&op);
+
+    mqdbg("upgrading a message of %s to %d deliveries", qname,
+            MQ_MAX_DELIVERIES);
+    if (MONGO_OK != mongo_update(conn, name_spc, &cond, &op, 0, NULL)) {
+        mqerr("upgrade of a message of %s failed", qname);
+        ret_code = mongo_to_mq(conn->err);
+    }
+    bson_destroy(&op);
+    bson_destroy(&cond);
+
+    return ret_code;
+}
+
+
+/**
+ * db_lease()
+ *
+ * Lease the oldest deliverable message of the queue 'qname'. The message
+ * is not removed; it is hidden for 'lease_ms' & is delivered again unless
+ * it is acked, by db_ack(), within that time. The id it is acked with is
+ * <message id>-<end of the lease>, so that it acks this lease only.
+ *
+ *  conn       - mongo db connection object
+ *  qname      - name of the queue from where data is leased
+ *  lease_ms   - the data is hidden from other pops for these many milli secs
+ *  val        - string formatted data that is returned; MQ_MAX_DATA_LEN
+ *               long. If no data is found then '\0' is returned.
+ *  id         - id of the message, to be acked with, is returned here;
+ *               MQ_MSG_ID_LEN long
+ *  deliveries - # of times the message has been leased, including this one
+ *  tr         - trace of the request (can be NULL)
+ *
+ *  A message pushed before deliveries were bounded has no deliveries_left,
+ *  so the $inc leaves it at -1; it is given the default MQ_MAX_DELIVERIES
+ *  on its first lease, before the dead letter sweep can see it, as its
+ *  lease hides it till then.
+ *
+ **/
+mq_err_t
+db_lease(mongo *conn, const char *qname, unsigned int lease_ms, char *val,
+         char *id, int *deliveries, mq_trace_t *tr)
+{
+    int result = -1;
+    mq_err_t ret_code = MQ_ERR;
+    int64_t lease_end = now_ms() + lease_ms;
+    bson cmd, out;
+    mq_msg_t msg;
+    bool legacy = false;
+
+    /*
+     * <db>.<q>.findAndModify({query: <visible>, sort: {_id: 1}, new: true,
+     *                         update: {$set: {visible_at: <now + lease>},
+     *                                  $inc: {deliveries: 1,
+     *                                         deliveries_left: -1}}})
+     */
+    bson_init(&cmd);
+    bson_append_string(&cmd, "findAndModify", qname);
+        append_visible_query(&cmd);
+        bson_append_start_object(&cmd, "sort");
+            bson_append_int(&cmd, "_id", 1);
+        bson_append_finish_object(&cmd);
+        bson_append_start_object(&cmd, "update");
+            bson_append_start_object(&cmd, "$set");
+                bson_append_long(&cmd, "visible_at", lease_end);
+            bson_append_finish_object(&cmd);
+            bson_append_start_object(&cmd, "$inc");
+                bson_append_int(&cmd, "deliveries", 1);
+                bson_append_int(&cmd, "deliveries_left", -1);
+            bson_append_finish_object(&cmd);
+        bson_append_finish_object(&cmd);
+        bson_append_bool(&cmd, "new", true);
+    bson_finish(&cmd);
+
+    trace_mark(tr, MQ_STAGE_DB_SEND);
+    result = mongo_run_command(conn, MONGO_DB_NAME, &cmd, &out);
+    trace_mark(tr, MQ_STAGE_DB_REPLY);
+    if (MONGO_OK != result) {
+        mqerr("run command failed.");
+        ret_code = mongo_to_mq(conn->err);
+        goto end;
+    }
+
+    val[0] = id[0] = '\0';
+    *deliveries = 0;
+    ret_code = MQ_OK;               /* an empty queue is not an error */
+    if (db_reply_msg(&out, &msg) && msg.mg_has_oid) {
+        if (NULL != msg.mg_val)
+            snprintf(val, MQ_MAX_DATA_LEN, "%s", msg.mg_val);
+        bson_oid_to_string(&msg.mg_oid, id);
+        snprintf(id + 24, MQ_MSG_ID_LEN - 24, "-%lld", (long long) lease_end);
+        *deliveries = msg.mg_deliveries;
+        legacy = !msg.mg_bounded;
+        mqdbg("qname: %s   id: %s   deliveries: %d", qname, id, *deliveries);
     }
     bson_destroy(&out);
 
+    if (legacy)
+        ret_code = lease_upgrade(conn, qname, &msg.mg_oid, *deliveries);
+
 end:
     bson_destroy(&cmd);
     return ret_code;
 }
+
+
+/**
+ * db_ack()
+ *
+ * Ack, i.e., remove, a leased message so that it is not delivered again.
+ * Only the lease 'id' was returned for is acked; once the message has been
+ * leased again, acked already or moved to the dead letters, it is not.
+ *
+ *  conn       - mongo db connection object
+ *  qname      - name of the queue the message was leased from
+ *  id         - <message id>-<end of the lease>, as returned by db_lease()
+ *
+ **/
+mq_err_t
+db_ack(mongo *conn, const char *qname, const char *id)
+{
+    int result = -1;
+    mq_err_t ret_code = MQ_OK;
+    bson cmd, out;
+    bson_iterator it;
+    bson_oid_t oid;
+
+    bson_oid_from_string(&oid, id);
+
+    /*
+     * <db>.<q>.findAndModify({query: {_id: <oid>, visible_at: <lease end>},
+     *                         remove: true})
+     * returns null if nothing was removed
+     */
+    bson_init(&cmd);
+    bson_append_string(&cmd, "findAndModify", qname);
+        bson_append_start_object(&cmd, "query");
+            bson_append_oid(&cmd, "_id", &oid);
+            bson_append_long(&cmd, "visible_at", strtoll(id + 25, NULL, 10));
+        bson_append_finish_object(&cmd);
+        bson_append_bool(&cmd, "remove", true);
+    bson_finish(&cmd);
+
+    result = mongo_run_command(conn, MONGO_DB_NAME, &cmd, &out);
+    bson_destroy(&cmd);
+    if (MONGO_OK != result) {
+        mqerr("failed to ack %s in %s", id, qname);
+        return mongo_to_mq(conn->err);
+    }
+
+    if (BSON_OBJECT != bson_find(&it, &out, "value")) {
+        mqdbg("%s in %s is not leased", id, qname);
+        ret_code = MQ_DB_MSG_NOT_LEASED;
+    }
+    bson_destroy(&out);
+
+    return ret_code;
+}
+
+
+/**
+ * append_unclaimed()
+ *
+ * Append the query for a dead letter that no replay has claimed, or whose
+ * claim is stale, to the bson object 'b':
+ *   {$or: [{replay_by: {$exists: false}}, {replay_at: {$lte: <stale>}}]}
+ *
+ *  b          - bson object being built
+ *
+ **/
+static void
+append_unclaimed(bson *b)
+{
+    bson_append_start_array(b, "$or");
+        bson_append_start_object(b, "0");
+            bson_append_start_object(b, "replay_by");
+                bson_append_bool(b, "$exists", false);
+            bson_append_finish_object(b);
+        bson_append_finish_object(b);
+        bson_append_start_object(b, "1");
+            bson_append_start_object(b, "replay_at");
+                bson_append_long(b, "$lte", now_ms() - MQ_DEAD_CLAIM_MS);
+            bson_append_finish_object(b);
+        bson_append_finish_object(b);
+    bson_append_finish_array(b);
+}
+
+
+/**
+ * replay_claim()
+ *
+ * Claim upto 'limit' dead letters of 'from_ns' for a replay, so that a
+ * concurrent replay does not replay them as well. The claim of each is
+ * atomic, as it is conditional on the dead letter being unclaimed still.
+ *
+ *  conn       - mongo db connection object
+ *  from_ns    - name space of the dead letter queue
+ *  limit      - max # of dead letters to be claimed
+ *  token      - id of the claim is returned here
+ *
+ **/
+static mq_err_t
+replay_claim(mongo *conn, const char *from_ns, int limit, bson_oid_t *token)
+{
+    mq_err_t ret_code = MQ_OK;
+    char idx[16];
+    bson query, fields, cond, op;
+    mongo_write_concern wc;
+    bson_iterator it;
+    mongo_cursor *cursor = NULL;
+    int n = 0;
+
+    bson_oid_gen(token);
+
+    bson_init(&query);
+    append_unclaimed(&query);
+    bson_finish(&query);
+    bson_init(&fields);
+    bson_append_int(&fields, "_id", 1);
+    bson_finish(&fields);
+
+    cursor = mongo_find(conn, from_ns, &query, &fields, limit, 0, 0);
+    bson_destroy(&fields);
+    bson_destroy(&query);
+    if (NULL == cursor) {
+        mqerr("find in %s failed", from_ns);
+        return mongo_to_mq(conn->err);
+    }
+
+    /* {_id: {$in: [<ids found>]}, $or: <unclaimed>} */
+    bson_init(&cond);
+    bson_append_start_object(&cond, "_id");
+    bson_append_start_array(&cond, "$in");
+    for (; n < limit && MONGO_OK == mongo_cursor_next(cursor); n++) {
+        bson_find(&it, mongo_cursor_bson(cursor), "_id");
+        snprintf(idx, sizeof(idx), "%d", n);
+        bson_append_element(&cond, idx, &it);
+    }
+    mongo_cursor_destroy(cursor);
+    bson_append_finish_array(&cond);
+    bson_append_finish_object(&cond);
+    append_unclaimed(&cond);
+    bson_finish(&cond);
+
+    if (0 == n)
+        goto destroy;
+
+    /* {$set: {replay_by: <token>, replay_at: <now>}} */
+    bson_init(&op);
+    bson_append_start_object(&op, "$set");
+        bson_append_oid(&op, "replay_by", token);
+        bson_append_long(&op, "replay_at", now_ms());
+    bson_append_finish_object(&op);
+    bson_finish(&op);
+
+    mongo_write_concern_init(&wc);
+    wc.w = 1;
+    mongo_write_concern_finish(&wc);
+
+    if (MONGO_OK != mongo_update(conn, from_ns, &cond, &op,
+                                 MONGO_UPDATE_MULTI, &wc)) {
+        mqerr("claim of %d in %s failed", n, from_ns);
+        ret_code = mongo_to_mq(conn->err);
+    }
+    mongo_write_concern_destroy(&wc);
+    bson_destroy(&op);
+
+destroy:
+    bson_destroy(&cond);
+    return ret_code;
+}
+
+
+/**
+ * db_move()
+ *
+ * Move upto 'limit' messages from the queue 'from' to the queue 'to', in a
+ * single batch insert followed by a single remove. When 'to_dead' is set
+ * only the dead letters, i.e., the ones that ran out of deliveries & whose
+ * last lease is over, are moved as is; else (a replay) the messages are
+ * claimed by replay_claim() first & those claimed are moved as fresh ones,
+ * with all their deliveries.
+ *
+ * The insert is done before the remove, so a failure in between leaves a
+ * message in both the queues rather than losing it. Both are acknowledged
+ * (w=1), as the default write concern of the connection does not report
+ * a failed write.
+ *
+ *  conn       - mongo db connection object
+ *  from       - name of the queue messages are moved from
+ *  to         - name of the queue messages are moved to
+ *  to_dead    - move only the dead letters
+ *  limit      - max # of messages to be moved; upto MQ_DEAD_BATCH
+ *  moved      - # of messages moved is returned here
+ *
+ **/
+mq_err_t
+db_move(mongo *conn, const char *from, const char *to, bool to_dead,
+        int limit, int *moved)
+{
+    mq_err_t ret_code = MQ_ERR;
+    char from_ns[NAME_SPC_MAX_LEN], to_ns[NAME_SPC_MAX_LEN];
+    char idx[16];
+    bson query, rm;
+    bson_oid_t token;
+    mongo_write_concern wc;
+    bson docs[MQ_DEAD_BATCH];
+    const bson *batch[MQ_DEAD_BATCH];
+    bson_iterator it;
+    mongo_cursor *cursor = NULL;
+    int i = 0, n = 0, max_deliveries = 0;
+
+    *moved = 0;
+    if (limit > MQ_DEAD_BATCH)
+        limit = MQ_DEAD_BATCH;
+
+    ret_code = db_name_spc(conn, from, from_ns);
+    if (MQ_OK != ret_code)
+        goto end;
+    ret_code = db_name_spc(conn, to, to_ns);
+    if (MQ_OK != ret_code)
+        goto end;
+
+    if (!to_dead) {
+        ret_code = replay_claim(conn, from_ns, limit, &token);
+        if (MQ_OK != ret_code)
+            goto end;
+    }
+
+    /*
+     * {deliveries_left: {$lte: 0}, visible_at: {$lte: <now>}} or
+     * {replay_by: <token>}
+     */
+    bson_init(&query);
+    if (to_dead) {
+        bson_append_start_object(&query, "deliveries_left");
+            bson_append_int(&query, "$lte", 0);
+        bson_append_finish_object(&query);
+        bson_append_start_object(&query, "visible_at");
+            bson_append_long(&query, "$lte", now_ms());
+        bson_append_finish_object(&query);
+    } else {
+        bson_append_oid(&query, "replay_by", &token);
+    }
+    bson_finish(&query);
+
+    cursor = mongo_find(conn, from_ns, &query, NULL, limit, 0, 0);
+    bson_destroy(&query);
+    if (NULL == cursor) {
+        mqerr("find in %s failed", from);
+        ret_code = mongo_to_mq(conn->err);
+        goto end;
+    }
+
+    /* {_id: {$in: [<ids of the moved messages>]}} */
+    bson_init(&rm);
+    bson_append_start_object(&rm, "_id");
+    bson_append_start_array(&rm, "$in");
+
+    for (; n < limit && MONGO_OK == mongo_cursor_next(cursor); n++) {
+        const bson *cur = mongo_cursor_bson(cursor);
+
+        bson_find(&it, cur, "_id");
+        snprintf(idx, sizeof(idx), "%d", n);
+        bson_append_element(&rm, idx, &it);
+
+        bson_init(&docs[n]);
+        if (to_dead) {
+            bson_iterator_init(&it, cur);
+            while (bson_iterator_next(&it))
+                bson_append_element(&docs[n], NULL, &it);
+            bson_append_long(&docs[n], "dead_at", now_ms());
+        } else {
+            max_deliveries = MQ_MAX_DELIVERIES;
+            if (BSON_EOO != bson_find(&it, cur, "max_deliveries"))
+                max_deliveries = bson_iterator_int(&it);
+
+            bson_append_int(&docs[n], "ts", time(NULL));
+            bson_append_long(&docs[n], "visible_at", now_ms());
+            if (BSON_STRING == bson_find(&it, cur, "val"))
+                bson_append_element(&docs[n], NULL, &it);
+            bson_append_int(&docs[n], "deliveries", 0);
+            bson_append_int(&docs[n], "deliveries_left", max_deliveries);
+            bson_append_int(&docs[n], "max_deliveries", max_deliveries);
+        }
+        bson_finish(&docs[n]);
+        batch[n] = &docs[n];
+    }
+    mongo_cursor_destroy(cursor);
+
+    bson_append_finish_array(&rm);
+    bson_append_finish_object(&rm);
+    bson_finish(&rm);
+
+    ret_code = MQ_OK;
+    if (0 == n)
+        goto destroy;
+
+    mongo_write_concern_init(&wc);
+    wc.w = 1;
+    mongo_write_concern_finish(&wc);
+
+    if (MONGO_OK != mongo_insert_batch(conn, to_ns, batch, n, &wc, 0)) {
+        mqerr("batch insert of %d into %s failed", n, to);
+        ret_code = mongo_to_mq(conn->err);
+        goto destroy_wc;
+    }
+
+    if (MONGO_OK != mongo_remove(conn, from_ns, &rm, &wc)) {
+        mqerr("remove of %d moved from %s failed", n, from);
+        ret_code = mongo_to_mq(conn->err);
+        goto destroy_wc;
+    }
+
+    *moved = n;
+    mqdbg("moved %d from %s to %s", n, from, to);
+
+destroy_wc:
+    mongo_write_concern_destroy(&wc);
+destroy:
+    for (i = 0; i < n; i++)
+        bson_destroy(&docs[i]);
+    bson_destroy(&rm);
+end:
+    return ret_code;
+}
+
+
+/**
+ * db_dead_list()
+ *
+ * Write upto 'limit' dead letters of the dead letter queue 'qname' into
+ * 'buf', one per line: <id> <deliveries> <dead_at> <val>
+ *
+ *  conn       - mongo db connection object
+ *  qname      - name of the dead letter queue
+ *  limit      - max # of dead letters to be listed
+ *  buf        - event buffer into which the dead letters are written
+ *
+ **/
+mq_err_t
+db_dead_list(mongo *conn, const char *qname, int limit, struct evbuffer *buf)
+{
+    mq_err_t ret_code = MQ_ERR;
+    char name_spc[NAME_SPC_MAX_LEN];
+    char id[MQ_MSG_ID_LEN];
+    bson query;
+    bson_iterator it;
+    mongo_cursor *cursor = NULL;
+    int deliveries = 0;
+    long long dead_at = 0;
+
+    ret_code = db_name_spc(conn, qname, name_spc);
+    if (MQ_OK != ret_code)
+        goto end;
+
+    bson_init(&query);
+    bson_finish(&query);
+    cursor = mongo_find(conn, name_spc, &query, NULL, limit, 0, 0);
+    bson_destroy(&query);
+    if (NULL == cursor) {
+        mqerr("find in %s failed", qname);
+        ret_code = mongo_to_mq(conn->err);
+        goto end;
+    }
+
+    while (MONGO_OK == mongo_cursor_next(cursor)) {
+        const bson *cur = mongo_cursor_bson(cursor);
+
+        id[0] = '\0';
+        if (BSON_OID == bson_find(&it, cur, "_id"))
+            bson_oid_to_string(bson_iterator_oid(&it), id);
+        deliveries = (BSON_EOO != bson_find(&it, cur, "deliveries")) ?
+                        bson_iterator_int(&it) : 0;
+        dead_at = (BSON_EOO != bson_find(&it, cur, "dead_at")) ?
+                        bson_iterator_long(&it) : 0;
+
+        evbuffer_add_printf(buf, "%s %d %lld %s\n", id, deliveries, dead_at,
+                (BSON_STRING == bson_find(&it, cur, "val")) ?
+                    bson_iterator_string(&it) : "");
+    }
+    mongo_cursor_destroy(cursor);
+
+end:
+    return ret_code;
+}
+
+
+/**
+ * topic_name_spc()
+ *
+ * Build & validate the name space of the collection, <topic>.topic, that
+ * holds the messages of the topic 'topic'
+ *
+ *  conn       - mongo db connection object
+ *  topic      - name of the topic
+ *  name_spc   - name space is returned here; NAME_SPC_MAX_LEN long
+ *
+ **/
+static mq_err_t
+topic_name_spc(mongo *conn, const char *topic, char *name_spc)
+{
+    char coll[NAME_SPC_MAX_LEN];
+    int len = snprintf(coll, sizeof(coll), "%s%s", topic, TOPIC_COLL_SUFFIX);
+
+    if (len < 0 || (int) sizeof(coll) <= len) {
+        mqerr("topic name is too long: %s", topic);
+        return MQ_DB_QNAME_TOO_LONG;
+    }
+
+    return db_name_spc(conn, coll, name_spc);
+}
+
+
+/**
+ * topic_offset()
+ *
+ * Get the offset, i.e., the seq # of the last message consumed, of the
+ * consumer group 'gid'. The offset is only read; a group seen for the
+ * first time is created with the offset 0, i.e., it starts with the oldest
+ * message still retained.
+ *
+ *  conn       - mongo db connection object
+ *  topic      - name of the topic
+ *  group      - name of the consumer group
+ *  gid        - id of the group, <topic>.<group>
+ *  off        - offset is returned here
+ *  tr         - trace of the request (can be NULL)
+ *
+ **/
+static mq_err_t
+topic_offset(mongo *conn, const char *topic, const char *group,
+             const char *gid, int64_t *off, mq_trace_t *tr)
+{
+    mq_err_t ret_code = MQ_ERR;
+    char group_ns[NAME_SPC_MAX_LEN];
+    int result = -1;
+    bson query, cmd, out;
+    bson_iterator it, it_sub;
+    bson_type type;
+
+    *off = 0;
+    ret_code = db_name_spc(conn, TOPIC_GROUP_COLL, group_ns);
+    if (MQ_OK != ret_code)
+        return ret_code;
+
+    /* <db>.mq.groups.findOne({_id: <gid>}) */
+    bson_init(&query);
+    bson_append_string(&query, "_id", gid);
+    bson_finish(&query);
+
+    trace_mark(tr, MQ_STAGE_DB_SEND);
+    result = mongo_find_one(conn, group_ns, &query, NULL, &out);
+    trace_mark(tr, MQ_STAGE_DB_REPLY);
+    bson_destroy(&query);
+    if (MONGO_OK == result) {
+        type = bson_find(&it, &out, "off");
+        if (BSON_LONG == type || BSON_INT == type)
+            *off = bson_iterator_long(&it);
+        bson_destroy(&out);
+        return MQ_OK;
+    }
+
+    /*
+     * not found, i.e., a new group, which may be created by another pop
+     * in the meantime; the offset is read back from whichever one won
+     *
+     * <db>.mq.groups.findAndModify({query: {_id: <gid>}, upsert: true,
+     *      update: {$setOnInsert: {topic: <t>, group: <g>, off: 0}},
+     *      new: true})
+     */
+    bson_init(&cmd);
+    bson_append_string(&cmd, "findAndModify", TOPIC_GROUP_COLL);
+        bson_append_start_object(&cmd, "query");
+            bson_append_string(&cmd, "_id", gid);
+        bson_append_finish_object(&cmd);
+        bson_append_start_object(&cmd, "update");
+            bson_append_start_object(&cmd, "$setOnInsert");
+                bson_append_string(&cmd, "topic", topic);
+                bson_append_string(&cmd, "group", group);
+                bson_append_long(&cmd, "off", 0);
+            bson_append_finish_object(&cmd);
+        bson_append_finish_object(&cmd);
+        bson_append_bool(&cmd, "upsert", true);
+        bson_append_bool(&cmd, "new", true);
+    bson_finish(&cmd);
+
+    trace_mark(tr, MQ_STAGE_DB_SEND);
+    result = mongo_run_command(conn, MONGO_DB_NAME, &cmd, &out);
+    trace_mark(tr, MQ_STAGE_DB_REPLY);
+    bson_destroy(&cmd);
+    if (MONGO_OK != result) {
+        mqerr("offset of %s failed", gid);
+        return mongo_to_mq(conn->err);
+    }
+
+    if (BSON_OBJECT == bson_find(&it, &out, "value")) {
+        bson_iterator_from_buffer(&it_sub, bson_iterator_value(&it));
+        while (BSON_EOO != (type = bson_iterator_next(&it_sub)))
+            if (0 == strcmp("off", bson_iterator_key(&it_sub)) &&
+                    (BSON_LONG == type || BSON_INT == type))
+                *off = bson_iterator_long(&it_sub);
+    }
+    bson_destroy(&out);
+    mqdbg("new group %s of %s", group, topic);
+
+    return MQ_OK;
+}
+
+
+/**
+ * topic_commit()
+ *
+ * Move the offset of the group 'gid' from 'off' to 'next', provided no one
+ * else has moved it in the meantime
+ *
+ *  conn       - mongo db connection object
+ *  gid        - id of the group, <topic>.<group>
+ *  off        - offset the group is expected to be at
+ *  next       - new offset
+ *  moved      - whether the offset was moved is returned here
+ *  tr         - trace of the request (can be NULL)
+ *
+ **/
+static mq_err_t
+topic_commit(mongo *conn, const char *gid, int64_t off, int64_t next,
+             bool *moved, mq_trace_t *tr)
+{
+    int result = -1;
+    bson cmd, out;
+    bson_iterator it;
+
+    /*
+     * <db>.mq.groups.findAndModify({query: {_id: <gid>, off: <off>},
+     *                               update: {$set: {off: <next>}}})
+     */
+    bson_init(&cmd);
+    bson_append_string(&cmd, "findAndModify", TOPIC_GROUP_COLL);
+        bson_append_start_object(&cmd, "query");
+            bson_append_string(&cmd, "_id", gid);
+            bson_append_long(&cmd, "off", off);
+        bson_append_finish_object(&cmd);
+        bson_append_start_object(&cmd, "update");
+            bson_append_start_object(&cmd, "$set");
+                bson_append_long(&cmd, "off", next);
+            bson_append_finish_object(&cmd);
+        bson_append_finish_object(&cmd);
+    bson_finish(&cmd);
+
+    trace_mark(tr, MQ_STAGE_DB_SEND);
+    result = mongo_run_command(conn, MONGO_DB_NAME, &cmd, &out);
+    trace_mark(tr, MQ_STAGE_DB_REPLY);
+    bson_destroy(&cmd);
+    if (MONGO_OK != result) {
+        mqerr("commit of %s failed", gid);
+        return mongo_to_mq(conn->err);
+    }
+
+    /* 'value' is null if the offset was moved by another pop */
+    *moved = (BSON_OBJECT == bson_find(&it, &out, "value")) ? true : false;
+    bson_destroy(&out);
+
+    return MQ_OK;
+}
+
+
+/**
+ * db_topic_push()
+ *
+ * Push the 'val' into the topic 'topic'. The message is stored once, with
+ * the next seq # of the topic as its '_id', whatever the # of consumer
+ * groups.
+ *
+ *  conn       - mongo db connection object
+ *  topic      - name of the topic
+ *  val        - string formatted data to be pushed
+ *  seq        - seq # of the message is returned here
+ *  tr         - trace of the request (can be NULL)
+ *
+ **/
+mq_err_t
+db_topic_push(mongo *conn, const char *topic, const char *val, int64_t *seq,
+              mq_trace_t *tr)
+{
+    int result = -1;
+    mq_err_t ret_code = MQ_ERR;
+    char name_spc[NAME_SPC_MAX_LEN];
+    bson cmd, out, b;
+    bson_iterator it, it_sub;
+
+    ret_code = topic_name_spc(conn, topic, name_spc);
+    if (MQ_OK != ret_code)
+        goto end;
+
+    /*
+     * <db>.mq.topics.findAndModify({query: {_id: <topic>}, upsert: true,
+     *                               update: {$inc: {seq: 1}}, new: true})
+     */
+    bson_init(&cmd);
+    bson_append_string(&cmd, "findAndModify", TOPIC_SEQ_COLL);
+        bson_append_start_object(&cmd, "query");
+            bson_append_string(&cmd, "_id", topic);
+        bson_append_finish_object(&cmd);
+        bson_append_start_object(&cmd, "update");
+            bson_append_start_object(&cmd, "$inc");
+                bson_append_long(&cmd, "seq", 1);
+            bson_append_finish_object(&cmd);
+        bson_append_finish_object(&cmd);
+        bson_append_bool(&cmd, "upsert", true);
+        bson_append_bool(&cmd, "new", true);
+    bson_finish(&cmd);
+
+    trace_mark(tr, MQ_STAGE_DB_SEND);
+    result = mongo_run_command(conn, MONGO_DB_NAME, &cmd, &out);
+    bson_destroy(&cmd);
+    if (MONGO_OK != result) {
+        mqerr("seq # of %s failed", topic);
+        ret_code = mongo_to_mq(conn->err);
+        goto end;
+    }
+
+    *seq = 0;
+    if (BSON_OBJECT == bson_find(&it, &out, "value")) {
+        bson_iterator_from_buffer(&it_sub, bson_iterator_value(&it));
+        while (bson_iterator_next(&it_sub))
+            if (0 == strcmp("seq", bson_iterator_key(&it_sub)))
+                *seq = bson_iterator_long(&it_sub);
+    }
+    bson_destroy(&out);
+
+    if (0 == *seq) {
+        mqerr("no seq # for %s", topic);
+        ret_code = MQ_DB_RUN_COMMAND_FAILED;
+        goto end;
+    }
+
+    bson_init(&b);
+    bson_append_long(&b, "_id", *seq);
+    bson_append_int(&b, "ts", time(NULL));
+    bson_append_long(&b, "pushed_at", now_ms());
+    bson_append_string(&b, "val", val);
+    bson_finish(&b);
+
+    mqdbg("about to insert #%lld (%s) into topic(%s)", (long long) *seq, val,
+            topic);
+    if (MONGO_OK != mongo_insert(conn, name_spc, &b, NULL)) {
+        mqerr("failed to insert: %s", val);
+        ret_code = mongo_to_mq(conn->err);
+    }
+    trace_mark(tr, MQ_STAGE_DB_REPLY);
+    bson_destroy(&b);
+
+end:
+    return ret_code;
+}
+
+
+/**
+ * db_topic_pop()
+ *
+ * Pop the message next to the offset of the consumer group 'group' from
+ * the topic 'topic'. Only the group's offset is moved; the message stays
+ * for the other groups until it is compacted by db_topic_compact().
+ *
+ * Seq #s are handed out before the insert, so a message may show up after
+ * a later one. The group does not skip over such a gap till the message
+ * past it is MQ_TOPIC_GAP_MS old; by then the push has either made it or
+ * has failed.
+ *
+ *  conn       - mongo db connection object
+ *  topic      - name of the topic
+ *  group      - name of the consumer group
+ *  val        - string formatted data that is returned; MQ_MAX_DATA_LEN
+ *               long. If no data is found then '\0' is returned.
+ *  seq        - seq # of the message is returned here
+ *  tr         - trace of the request (can be NULL)
+ *
+ **/
+mq_err_t
+db_topic_pop(mongo *conn, const char *topic, const char *group, char *val,
+             int64_t *seq, mq_trace_t *tr)
+{
+    mq_err_t ret_code = MQ_ERR;
+    char name_spc[NAME_SPC_MAX_LEN];
+    char gid[2 * MQ_MAX_QNAME_LEN + 2];         /* <topic>.<group> */
+    int64_t off = 0;
+    bson query, out;
+    mq_msg_t msg;
+    bool moved = false;
+    int len = 0, tries = 0;
+
+    val[0] = '\0';
+    *seq = 0;
+
+    ret_code = topic_name_spc(conn, topic, name_spc);
+    if (MQ_OK != ret_code)
+        goto end;
+
+    len = snprintf(gid, sizeof(gid), "%s.%s", topic, group);
+    if (len < 0 || (int) sizeof(gid) <= len) {
+        mqerr("group name is too long: %s", group);
+        ret_code = MQ_DB_QNAME_TOO_LONG;
+        goto end;
+    }
+
+    /* retried only when another pop of the same group has won the race */
+    for (; tries < MQ_TOPIC_POP_RETRIES; tries++) {
+        ret_code = topic_offset(conn, topic, group, gid, &off, tr);
+        if (MQ_OK != ret_code)
+            goto end;
+
+        /* {$query: {_id: {$gt: <off>}}, $orderby: {_id: 1}} */
+        bson_init(&query);
+        bson_append_start_object(&query, "$query");
+            bson_append_start_object(&query, "_id");
+                bson_append_long(&query, "$gt", off);
+            bson_append_finish_object(&query);
+        bson_append_finish_object(&query);
+        bson_append_start_object(&query, "$orderby");
+            bson_append_int(&query, "_id", 1);
+        bson_append_finish_object(&query);
+        bson_finish(&query);
+
+        trace_mark(tr, MQ_STAGE_DB_SEND);
+        if (MONGO_OK != mongo_find_one(conn, name_spc, &query, NULL, &out)) {
+            trace_mark(tr, MQ_STAGE_DB_REPLY);
+            bson_destroy(&query);
+            ret_code = MQ_OK;       /* an empty topic is not an error */
+            goto end;
+        }
+        trace_mark(tr, MQ_STAGE_DB_REPLY);
+        bson_destroy(&query);
+
+        db_msg_decode(bson_data(&out), &msg);
+        *seq = msg.mg_seq;
+        if (*seq <= off) {
+            /* not a message of this topic, as pushed by db_topic_push() */
+            mqerr("#%lld of %s is not after #%lld", (long long) *seq, topic,
+                    (long long) off);
+            bson_destroy(&out);
+            ret_code = MQ_DB_BSON_INVALID;
+            goto end;
+        }
+        if (off + 1 != *seq &&
+                msg.mg_pushed_at + MQ_TOPIC_GAP_MS > now_ms()) {
+            mqdbg("%s waiting for #%lld of %s", gid, (long long) off + 1,
+                    topic);
+            bson_destroy(&out);
+            *seq = 0;
+            goto end;
+        }
+
+        ret_code = topic_commit(conn, gid, off, *seq, &moved, tr);
+        if (MQ_OK == ret_code && moved && NULL != msg.mg_val)
+            snprintf(val, MQ_MAX_DATA_LEN, "%s", msg.mg_val);
+        bson_destroy(&out);
+
+        if (MQ_OK != ret_code || moved)
+            goto end;
+    }
+
+    mqdbg("%s lost %d races for %s", gid, tries, topic);
+    *seq = 0;
+
+end:
+    if ('\0' == val[0])
+        *seq = 0;
+    return ret_code;
+}
+
+
+/**
+ * db_topic_compact()
+ *
+ * Remove the messages of the topic 'topic' that all of its consumer groups
+ * have consumed. A topic without any group is left as is.
+ *
+ *  conn       - mongo db connection object
+ *  topic      - name of the topic
+ *
+ **/
+mq_err_t
+db_topic_compact(mongo *conn, const char *topic)
+{
+    mq_err_t ret_code = MQ_ERR;
+    char name_spc[NAME_SPC_MAX_LEN];
+    char group_ns[NAME_SPC_MAX_LEN];
+    bson query, rm;
+    bson_iterator it;
+    mongo_cursor *cursor = NULL;
+    int64_t off = 0, min_off = -1;
+
+    ret_code = topic_name_spc(conn, topic, name_spc);
+    if (MQ_OK != ret_code)
+        goto end;
+    ret_code = db_name_spc(conn, TOPIC_GROUP_COLL, group_ns);
+    if (MQ_OK != ret_code)
+        goto end;
+
+    /* the slowest group, i.e., the min offset of {topic: <topic>} */
+    bson_init(&query);
+    bson_append_string(&query, "topic", topic);
+    bson_finish(&query);
+    cursor = mongo_find(conn, group_ns, &query, NULL, 0, 0, 0);
+    bson_destroy(&query);
+    if (NULL == cursor) {
+        mqerr("find of the groups of %s failed", topic);
+        ret_code = mongo_to_mq(conn->err);
+        goto end;
+    }
+
+    while (MONGO_OK == mongo_cursor_next(cursor)) {
+        off = (BSON_EOO != bson_find(&it, mongo_cursor_bson(cursor), "off")) ?
+                    bson_iterator_long(&it) : 0;
+        if (min_off < 0 || off < min_off)
+            min_off = off;
+    }
+    mongo_cursor_destroy(cursor);
+
+    if (min_off <= 0)
+        goto end;
+
+    /* {_id: {$lte: <min offset>}} */
+    bson_init(&rm);
+    bson_append_start_object(&rm, "_id");
+        bson_append_long(&rm, "$lte", min_off);
+    bson_append_finish_object(&rm);
+    bson_finish(&rm);
+
+    if (MONGO_OK != mongo_remove(conn, name_spc, &rm, NULL)) {
+        mqerr("compaction of %s upto #%lld failed", topic,
+                (long long) min_off);
+        ret_code = mongo_to_mq(conn->err);
+    } else {
+        mqdbg("compacted %s upto #%lld", topic, (long long) min_off);
+    }
+    bson_destroy(&rm);
+
+end:
+    return ret_code;
+}
+
+
+/**
+ * db_dedup_init()
+ *
+ * Create the TTL index on the idempotency keys, so that mongo db expires
+ * them MQ_DEDUP_TTL_SECS after they were claimed. Their '_id' is unique
+ * already. Creating an existing index is a no-op.
+ *
+ *  conn       - mongo db connection object
+ *
+ **/
+mq_err_t
+db_dedup_init(mongo *conn)
+{
+    mq_err_t ret_code = MQ_OK;
+    bson cmd, out;
+
+    /*
+     * <db>.runCommand({createIndexes: "mq.dedup",
+     *                  indexes: [{key: {at: 1}, name: "at_ttl",
+     *                             expireAfterSeconds: <ttl>}]})
+     */
+    bson_init(&cmd);
+    bson_append_string(&cmd, "createIndexes", DEDUP_COLL);
+        bson_append_start_array(&cmd, "indexes");
+            bson_append_start_object(&cmd, "0");
+                bson_append_start_object(&cmd, "key");
+                    bson_append_int(&cmd, "at", 1);
+                bson_append_finish_object(&cmd);
+                bson_append_string(&cmd, "name", DEDUP_TTL_INDEX);
+                bson_append_int(&cmd, "expireAfterSeconds", MQ_DEDUP_TTL_SECS);
+            bson_append_finish_object(&cmd);
+        bson_append_finish_array(&cmd);
+    bson_finish(&cmd);
+
+    if (MONGO_OK != mongo_run_command(conn, MONGO_DB_NAME, &cmd, &out)) {
+        mqerr("creation of the index %s failed", DEDUP_TTL_INDEX);
+        ret_code = mongo_to_mq(conn->err);
+    } else {
+        bson_destroy(&out);
+    }
+    bson_destroy(&cmd);
+
+    return ret_code;
+}
+
+
+/**
+ * dedup_move()
+ *
+ * Move the idempotency key 'id' from the pending claim made at 'at' to
+ * 'state' at 'new_at', provided no one else has moved it in the meantime
+ *
+ *  conn       - mongo db connection object
+ *  id         - <qname>.<idempotency key>
+ *  at         - time of the claim, which identifies it
+ *  state      - new state
+ *  new_at     - new time of the key
+ *  moved      - whether the key was moved is returned here
+ *  tr         - trace of the request (can be NULL)
+ *
+ **/
+static mq_err_t
+dedup_move(mongo *conn, const char *id, int64_t at, const char *state,
+           int64_t new_at, bool *moved, mq_trace_t *tr)
+{
+    int result = -1;
+    bson cmd, out;
+    bson_iterator it;
+
+    /*
+     * <db>.mq.dedup.findAndModify({query: {_id: <id>, state: "pending",
+     *                                      at: <at>},
+     *          update: {$set: {state: <state>, at: <new_at>}}})
+     */
+    bson_init(&cmd);
+    bson_append_string(&cmd, "findAndModify", DEDUP_COLL);
+        bson_append_start_object(&cmd, "query");
+            bson_append_string(&cmd, "_id", id);
+            bson_append_string(&cmd, "state", DEDUP_PENDING);
+            bson_append_date(&cmd, "at", at);
+        bson_append_finish_object(&cmd);
+        bson_append_start_object(&cmd, "update");
+            bson_append_start_object(&cmd, "$set");
+                bson_append_string(&cmd, "state", state);
+                bson_append_date(&cmd, "at", new_at);
+            bson_append_finish_object(&cmd);
+        bson_append_finish_object(&cmd);
+    bson_finish(&cmd);
+
+    trace_mark(tr, MQ_STAGE_DB_SEND);
+    result = mongo_run_command(conn, MONGO_DB_NAME, &cmd, &out);
+    trace_mark(tr, MQ_STAGE_DB_REPLY);
+    bson_destroy(&cmd);
+    if (MONGO_OK != result) {
+        mqerr("move of %s to %s failed", id, state);
+        return mongo_to_mq(conn->err);
+    }
+
+    *moved = (BSON_OBJECT == bson_find(&it, &out, "value")) ? true : false;
+    bson_destroy(&out);
+
+    return MQ_OK;
+}
+
+
+/**
+ * db_dedup_claim()
+ *
+ * Claim the idempotency key 'id' in a single round trip. A new key is
+ * claimed as pending, until db_dedup_done() or db_dedup_release(). A key
+ * that is done is a duplicate; so is one from before the states, which
+ * has none. A key that is pending is being pushed by another request,
+ * unless it has been so for MQ_DEDUP_PENDING_MS, when that push is taken
+ * to have died & the claim is taken over. As mongo db's TTL monitor runs
+ * once a minute, a key may outlive MQ_DEDUP_TTL_SECS by as much.
+ *
+ *  conn       - mongo db connection object
+ *  id         - <qname>.<idempotency key>
+ *  claim      - outcome of the claim is returned here
+ *  at         - time of the claim, to be passed on to db_dedup_done() or
+ *               db_dedup_release(), is returned here; that of the key, for
+ *               a key that is done
+ *  tr         - trace of the request (can be NULL)
+ *
+ **/
+mq_err_t
+db_dedup_claim(mongo *conn, const char *id, mq_claim_t *claim, int64_t *at,
+               mq_trace_t *tr)
+{
+    mq_err_t ret_code = MQ_ERR;
+    int result = -1;
+    int64_t now = now_ms();
+    int64_t old_at = 0;
+    bool found = false;
+    bool pending = false;
+    bool moved = false;
+    const char *key = NULL;
+    bson cmd, out;
+    bson_iterator it, it_sub;
+    bson_type type;
+
+    *claim = MQ_CLAIM_PENDING;
+    *at = now;
+
+    /*
+     * <db>.mq.dedup.findAndModify({query: {_id: <id>}, upsert: true,
+     *          update: {$setOnInsert: {state: "pending", at: <now>}}})
+     * returns the key as it was before, i.e., null if it is new
+     */
+    bson_init(&cmd);
+    bson_append_string(&cmd, "findAndModify", DEDUP_COLL);
+        bson_append_start_object(&cmd, "query");
+            bson_append_string(&cmd, "_id", id);
+        bson_append_finish_object(&cmd);
+        bson_append_start_object(&cmd, "update");
+            bson_append_start_object(&cmd, "$setOnInsert");
+                bson_append_string(&cmd, "state", DEDUP_PENDING);
+                bson_append_date(&cmd, "at", now);
+            bson_append_finish_object(&cmd);
+        bson_append_finish_object(&cmd);
+        bson_append_bool(&cmd, "upsert", true);
+    bson_finish(&cmd);
+
+    trace_mark(tr, MQ_STAGE_DB_SEND);
+    result = mongo_run_command(conn, MONGO_DB_NAME, &cmd, &out);
+    trace_mark(tr, MQ_STAGE_DB_REPLY);
+    bson_destroy(&cmd);
+    if (MONGO_OK != result) {
+        mqerr("claim of %s failed", id);
+        return mongo_to_mq(conn->err);
+    }
+
+    if (BSON_OBJECT == bson_find(&it, &out, "value")) {
+        found = true;
+        bson_iterator_from_buffer(&it_sub, bson_iterator_value(&it));
+        while (BSON_EOO != (type = bson_iterator_next(&it_sub))) {
+            key = bson_iterator_key(&it_sub);
+            if (0 == strcmp("state", key) && BSON_STRING == type &&
+                    0 == strcmp(DEDUP_PENDING, bson_iterator_string(&it_sub)))
+                pending = true;
+            else if (0 == strcmp("at", key) && BSON_DATE == type)
+                old_at = bson_iterator_date(&it_sub);
+        }
+    }
+    bson_destroy(&out);
+
+    if (!found) {
+        *claim = MQ_CLAIM_NEW;
+        return MQ_OK;
+    }
+    if (!pending) {
+        *claim = MQ_CLAIM_DONE;
+        *at = old_at;
+        return MQ_OK;
+    }
+    if (now - old_at < MQ_DEDUP_PENDING_MS)
+        return MQ_OK;
+
+    /* lost to another request if it has just taken it over, or finished */
+    ret_code = dedup_move(conn, id, old_at, DEDUP_PENDING, now, &moved, tr);
+    if (MQ_OK == ret_code && moved) {
+        mqwarn("took over %s, pending since %lld", id, (long long) old_at);
+        *claim = MQ_CLAIM_NEW;
+    }
+
+    return ret_code;
+}
+
+
+/**
+ * db_dedup_done()
+ *
+ * Mark the idempotency key 'id' claimed by db_dedup_claim() as done, once
+ * its push has gone through, unless it has been taken over since. Its TTL
+ * starts over. Not acknowledged, so that a push with a new key waits on a
+ * single round trip besides its own; a key that is not marked stays
+ * pending & its retry is pushed again once the claim is stale.
+ *
+ *  conn       - mongo db connection object
+ *  id         - <qname>.<idempotency key>
+ *  at         - time of the claim
+ *  tr         - trace of the request (can be NULL)
+ *
+ **/
+mq_err_t
+db_dedup_done(mongo *conn, const char *id, int64_t at, mq_trace_t *tr)
+{
+    mq_err_t ret_code = MQ_ERR;
+    char name_spc[NAME_SPC_MAX_LEN];
+    bson cond, op;
+
+    ret_code = db_name_spc(conn, DEDUP_COLL, name_spc);
+    if (MQ_OK != ret_code)
+        return ret_code;
+
+    /* {_id: <id>, state: "pending", at: <at>}, {$set: {state: "done", at}} */
+    bson_init(&cond);
+    bson_append_string(&cond, "_id", id);
+    bson_append_string(&cond, "state", DEDUP_PENDING);
+    bson_append_date(&cond, "at", at);
+    bson_finish(&cond);
+
+    bson_init(&op);
+    bson_append_start_object(&op, "$set");
+        bson_append_string(&op, "state", DEDUP_DONE);
+        bson_append_date(&op, "at", now_ms());
+    bson_append_finish_object(&op);
+    bson_finish(&op);
+
+    trace_mark(tr, MQ_STAGE_DB_SEND);
+    if (MONGO_OK != mongo_update(conn, name_spc, &cond, &op, 0, NULL)) {
+        mqerr("failed to mark %s as done", id);
+        ret_code = mongo_to_mq(conn->err);
+    }
+    bson_destroy(&op);
+    bson_destroy(&cond);
+
+    return ret_code;
+}
+
+
+/**
+ * db_dedup_release()
+ *
+ * Release the idempotency key 'id' claimed by db_dedup_claim(), unless it
+ * has been taken over since
+ *
+ *  conn       - mongo db connection object
+ *  id         - <qname>.<idempotency key>
+ *  at         - time of the claim
+ *  tr         - trace of the request (can be NULL)
+ *
+ **/
+mq_err_t
+db_dedup_release(mongo *conn, const char *id, int64_t at, mq_trace_t *tr)
+{
+    mq_err_t ret_code = MQ_ERR;
+    char name_spc[NAME_SPC_MAX_LEN];
+    mongo_write_concern wc;
+    bson b;
+
+    ret_code = db_name_spc(conn, DEDUP_COLL, name_spc);
+    if (MQ_OK != ret_code)
+        return ret_code;
+
+    bson_init(&b);
+    bson_append_string(&b, "_id", id);
+    bson_append_string(&b, "state", DEDUP_PENDING);
+    bson_append_date(&b, "at", at);
+    bson_finish(&b);
+
+    /* acknowledged, so that a retry right after does not find it pending */
+    mongo_write_concern_init(&wc);
+    wc.w = 1;
+    mongo_write_concern_finish(&wc);
+
+    trace_mark(tr, MQ_STAGE_DB_SEND);
+    if (MONGO_OK != mongo_remove(conn, name_spc, &b, &wc)) {
+        mqerr("failed to release %s", id);
+        ret_code = mongo_to_mq(conn->err);
+    }
+    trace_mark(tr, MQ_STAGE_DB_REPLY);
+    mongo_write_concern_destroy(&wc);
+    bson_destroy(&b);
+
+    return ret_code;
+}
@@ -7,10 +7,15 @@
  *
  */
 
+#define _POSIX_C_SOURCE 200112L /* sigwait() etc. with --std=c99 */
+
 /* system includes */
 #include <event.h>              /* libevent.* */
+#include <event2/thread.h>      /* evthread_use_pthreads */
 //#include <evhttp.h>             /* evhttp.* */
 #include <signal.h>             /* SIGTERM, SIGQUIT, SIGINT */
+#include <pthread.h>            /* pthread_sigmask */
+#include <stdio.h>              /* fprintf */
 
 //#include <mongo.h>              /* mongodb related */
 
@@ -21,38 +26,15 @@
 
 
 /* static variables */
-static struct event_base *main_base = NULL;
 bool daemon_quit = false;
 
-/**
- * event_handler()
- *
- * Called when an http event happens on the port
- *
- *  req        - http event request structure
- *  arg        - arg that was passed while setting up the event
- *
- **/
-void
-event_handler(struct evhttp_request *req, void *arg)
-{
-    struct evbuffer *buf = evbuffer_new();
-    if (NULL == buf) {
-        mqerr("unable to create event buffer");
-        evhttp_send_reply(req, HTTP_SERVUNAVAIL, "Service unavailable", NULL);
-        return;
-    }
-    mqdbg("event handler: %p", buf);
-
-    evbuffer_add_printf(buf, "Requested: %s\n", evhttp_request_uri(req));
-    evhttp_send_reply(req, HTTP_OK, "OK", buf);
-}
-
 
 /**
  * sig_handler()
  *
- * For safe exit, the termination signals are caught and handled.
+ * For safe exit, the termination signals are caught and handled. These
+ * are blocked in all the threads & waited for by main(), so this is not
+ * run in a signal context & is free to log.
  *
  *  sig_no     - signal #
  *
@@ -75,12 +57,9 @@ sig_handler(int sig_no)
     daemon_quit = true;
     mqlog("Signal(%d) caught. Trying to exit gracefully...", sig_no);
 
-    /* exit event loop first */
-    mqlog("exitting event base...");
-    if (0 == event_base_loopexit(main_base, 0))
-        mqlog("done!");
-    else
-        mqerr("error!!");
+    /* exit the event loops of all the workers first */
+    mqlog("exitting event bases...");
+    thread_stop();
 }
 
 
@@ -97,48 +76,46 @@ int
 main(int argc, char **argv)
 {
     mq_err_t ret_code = MQ_ERR;
+    sigset_t sigs;
+    int sig_no = 0;
 
-    /* Initialize an event base */
-    //main_base = event_init();
-    main_base = event_base_new();
-    if (NULL == main_base) {
-        mqerr("unable to initialize an event");
+    /* each worker has its own event base; make libevent thread safe so
+     * that they can be stopped from the main thread */
+    if (0 != evthread_use_pthreads()) {
+        mqerr("unable to initialize libevent threading");
         ret_code = MQ_EV_INIT_FAILED;
         goto end;
     }
-    mqdbg("event base: %p", main_base);
-
-    /* register for singal callback */
-    if (SIG_ERR == signal(SIGTERM, sig_handler))
-        fprintf(stderr, "Cannot catch SIGTERM");
-    if (SIG_ERR == signal(SIGQUIT, sig_handler))
-        fprintf(stderr, "Cannot catch SIGQUIT");
-    if (SIG_ERR == signal(SIGINT, sig_handler))
-        fprintf(stderr, "Cannot catch SIGINT");
-
-    /* connect to db */
-    ret_code = db_init();
-    if (MQ_OK != ret_code) {
-        mqerr("DB init has failed: %s", MQ_ERR_STR(ret_code));
-        goto db_init_failed;
-    }
-    mqdbg("connected to db: %d", ret_code);
 
-    /* create, initialize 'NTHREADS' threads */
-    ret_code = thread_init(MQ_NTHREADS, &event_handler, main_base);
+    /* the idempotency key cache is shared by all the workers */
+    ret_code = dedup_init();
+    if (MQ_OK != ret_code)
+        goto end;
+
+    /* block the termination signals; the workers inherit the mask */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGQUIT);
+    sigaddset(&sigs, SIGINT);
+    if (0 != pthread_sigmask(SIG_BLOCK, &sigs, NULL))
+        fprintf(stderr, "Cannot block SIGTERM, SIGQUIT & SIGINT");
+
+    /* create, initialize 'NTHREADS' threads, each with its own db conn */
+    ret_code = thread_init(MQ_NTHREADS, &event_handler);
     if (MQ_OK != ret_code) {
         mqerr("thread_init has failed: %s", MQ_ERR_STR(ret_code));
-        goto thread_init_failed;
+        goto end;
     }
-    mqdbg("created thread: %d", ret_code);
+    mqdbg("created threads: %d", ret_code);
+
+    /* wait for a termination signal */
+    while (false == daemon_quit) {
+        if (0 == sigwait(&sigs, &sig_no))
+            sig_handler(sig_no);
+    }
+    thread_join();
 
-db_init_failed:
 end:
     mqlog("exiting with ret_code: %d", ret_code);
     return ret_code;
-
-thread_init_failed:
-    mqdbg("cleaning up db init changes");
-    event_base_free(main_base);
-    goto end;
 }
@@ -10,21 +10,199 @@
 #ifndef _MONGOQ_H_
 #define _MONGOQ_H_
 
+#include <pthread.h>            /* pthread_t */
+#include <stdint.h>             /* uint64_t */
 #include <mongo.h>              /* mongodb related */
 #include <evhttp.h>             /* evhttp.* */
 
+/* max len of a lease id, <partition #>-<object id>-<end of the lease> */
+#define MQ_MSG_ID_LEN           64
+
+/* max len of a remembered idempotency key, <qname>.<key> */
+#define MQ_DEDUP_ID_LEN         128
+
 /**
  * Event handler function pointer that will be passed while creating
  * a thread.
  **/
 typedef void (*ev_hdlr)(struct evhttp_request *req, void *arg);
 
+/**
+ * Timer of the per worker timer wheel. Embedded in whatever needs to
+ * expire; must not be freed while pending.
+ **/
+typedef void (*tw_cb)(void *arg);
+
+typedef struct _tw_timer_t {
+    struct _tw_timer_t *tm_next;
+    struct _tw_timer_t *tm_prev;
+    struct _tw_timer_t **tm_slot;       /* slot it is in; NULL if idle */
+    uint64_t tm_expires;                /* tick at which it expires */
+    tw_cb tm_cb;
+    void *tm_arg;
+} tw_timer_t;
+
+typedef struct _tw_wheel_t tw_wheel_t;
+
+/* long poll state of a worker; defined in waiter.c */
+typedef struct _mq_wait_t mq_wait_t;
+
+/**
+ * Names, of queues or topics, tracked by a worker for periodic upkeep;
+ * defined in track.c. The callback is run on each of them with the
+ * worker's db connection.
+ **/
+typedef mq_err_t (*track_cb)(mongo *conn, const char *name);
+
+typedef struct _mq_track_t mq_track_t;
+
+/**
+ * Per worker thread state. A pointer to this is passed as the 'arg' to the
+ * event handler, so that each worker uses its own db connection.
+ **/
+typedef struct _ev_thread_t {
+    pthread_t evt_pthread;
+    struct event_base *evt_base; /* own base, dispatched by evt_pthread */
+    struct evhttp *evt_httpd;
+    int evt_id;                 /* worker #, used for partition affinity */
+    mongo *evt_conn;            /* this worker's db connection */
+    tw_wheel_t *evt_wheel;      /* due times & waiter timeouts */
+    mq_wait_t *evt_wait;        /* long poll waiters & due times */
+    mq_track_t *evt_dead;       /* queues swept for dead letters */
+    mq_track_t *evt_topics;     /* topics compacted */
+} ev_thread_t;
+
+/**
+ * Stages of a request that are timestamped while tracing it
+ **/
+typedef enum _mq_stage_t {
+    MQ_STAGE_ACCEPT = 0,        /* request handed over to event_handler() */
+    MQ_STAGE_PARSE,             /* uri parsed & routed */
+    MQ_STAGE_DB_SEND,           /* first request sent to mongo db */
+    MQ_STAGE_DB_REPLY,          /* last reply received from mongo db */
+    MQ_STAGE_FLUSH,             /* response handed over to evhttp */
+    MQ_STAGE_MAX
+} mq_stage_t;
+
+/**
+ * Per request trace. Lives on the stack of event_handler() & is passed down
+ * to the db functions, which accept a NULL trace as well.
+ **/
+typedef struct _mq_trace_t {
+    unsigned long tr_id;                /* request id */
+    const char *tr_qname;               /* queue name, if any */
+    int tr_db_calls;                    /* # of round trips to mongo db */
+    uint64_t tr_ts[MQ_STAGE_MAX];       /* monotonic timestamps, in usecs */
+} mq_trace_t;
+
+/**
+ * A message document as decoded by db_msg_decode(). The fields that are
+ * absent, or not of the expected type, are zeroed.
+ **/
+typedef struct _mq_msg_t {
+    const char *mg_val;         /* points into the document; NULL if none */
+    bson_oid_t mg_oid;          /* _id of a queue message ... */
+    bool mg_has_oid;
+    int64_t mg_seq;             /* ... or of a topic message */
+    int64_t mg_pushed_at;
+    int mg_deliveries;
+    bool mg_bounded;            /* has max_deliveries */
+} mq_msg_t;
+
+/**
+ * Outcome of the claim of an idempotency key by a push
+ **/
+typedef enum _mq_claim_t {
+    MQ_CLAIM_NEW = 0,           /* claimed; the push is to be done */
+    MQ_CLAIM_DONE,              /* pushed already, i.e., a duplicate */
+    MQ_CLAIM_PENDING            /* being pushed by another request */
+} mq_claim_t;
+
+/* tracing related functions */
+void trace_begin(mq_trace_t*);
+void trace_mark(mq_trace_t*, mq_stage_t);
+void trace_end(mq_trace_t*);
+void trace_dump(struct evbuffer*);
+
 /* db related functions */
-mq_err_t db_init(void);
-void db_deinit(void);
-mq_err_t db_push(mongo*, const char*, const char*);
+mq_err_t db_init(mongo**);
+void db_deinit(mongo*);
+mq_err_t db_push(mongo*, const char*, const char*, unsigned int,
+                 unsigned int, mq_trace_t*);
+void db_msg_decode(const char*, mq_msg_t*);
+bool db_reply_msg(const bson*, mq_msg_t*);
+mq_err_t db_pop(mongo*, const char*, char*, mq_trace_t*);
+mq_err_t db_lease(mongo*, const char*, unsigned int, char*, char*, int*,
+                  mq_trace_t*);
+mq_err_t db_ack(mongo*, const char*, const char*);
+mq_err_t db_move(mongo*, const char*, const char*, bool, int, int*);
+mq_err_t db_dead_list(mongo*, const char*, int, struct evbuffer*);
+mq_err_t db_topic_push(mongo*, const char*, const char*, int64_t*,
+                       mq_trace_t*);
+mq_err_t db_topic_pop(mongo*, const char*, const char*, char*, int64_t*,
+                      mq_trace_t*);
+mq_err_t db_topic_compact(mongo*, const char*);
+mq_err_t db_dedup_init(mongo*);
+mq_err_t db_dedup_claim(mongo*, const char*, mq_claim_t*, int64_t*,
+                        mq_trace_t*);
+mq_err_t db_dedup_done(mongo*, const char*, int64_t, mq_trace_t*);
+mq_err_t db_dedup_release(mongo*, const char*, int64_t, mq_trace_t*);
+
+/* partitioned queue functions */
+mq_err_t part_push(mongo*, const char*, const char*, const char*,
+                   unsigned int, unsigned int, mq_trace_t*);
+mq_err_t part_pop(mongo*, int, const char*, char*, mq_trace_t*);
+mq_err_t part_lease(mongo*, int, const char*, unsigned int, char*, char*,
+                    int*, mq_trace_t*);
+mq_err_t part_ack(mongo*, const char*, const char*);
+mq_err_t part_sweep(mongo*, const char*);
+mq_err_t part_replay(mongo*, const char*, int, int*);
+mq_err_t part_dead_list(mongo*, const char*, int, struct evbuffer*);
+
+/* timer wheel functions */
+tw_wheel_t* tw_new(struct event_base*);
+void tw_free(tw_wheel_t*);
+void tw_add(tw_wheel_t*, tw_timer_t*, unsigned int, tw_cb, void*);
+void tw_del(tw_wheel_t*, tw_timer_t*);
+uint64_t tw_ticks(tw_wheel_t*, unsigned int);
+
+/* long poll functions */
+mq_err_t waiter_init(ev_thread_t*, struct event_base*);
+void waiter_free(ev_thread_t*);
+mq_err_t waiter_park(ev_thread_t*, struct evhttp_request*, const char*,
+                     unsigned int);
+void waiter_notify(ev_thread_t*, const char*, unsigned int);
+
+/* tracked name functions */
+mq_err_t track_init(mq_track_t**, ev_thread_t*, struct event_base*,
+                    unsigned int, int, track_cb, const char*);
+void track_free(mq_track_t*);
+void track_add(mq_track_t*, const char*);
+
+/* dead letter functions */
+mq_err_t dead_init(ev_thread_t*, struct event_base*);
+void dead_free(ev_thread_t*);
+void dead_track(ev_thread_t*, const char*);
+
+/* duplicate suppression functions */
+mq_err_t dedup_init(void);
+mq_err_t dedup_begin(mongo*, const char*, const char*, mq_claim_t*,
+                     int64_t*, mq_trace_t*);
+void dedup_end(mongo*, const char*, const char*, int64_t, bool,
+               mq_trace_t*);
+
+/* topic functions */
+mq_err_t topic_init(ev_thread_t*, struct event_base*);
+void topic_free(ev_thread_t*);
+void topic_track(ev_thread_t*, const char*);
 
+/* http related functions */
+void send_reply(struct evhttp_request*, int, const char*, const char*);
+void event_handler(struct evhttp_request*, void*);
 
-mq_err_t thread_init(int, ev_hdlr, struct event_base*);
+mq_err_t thread_init(int, ev_hdlr);
+void thread_stop(void);
+void thread_join(void);
+ev_thread_t* thread_workers(int*);
 
 #endif /* _MONGOQ_H_ */
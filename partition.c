@@ -0,0 +1,334 @@
+/*
+ *  partition.c
+ *
+ *  Partitioned queues. A logical queue is spread across MQ_QUEUE_PARTITIONS
+ *  physical collections so that a single hot queue is not limited by the
+ *  contention on one collection's findAndModify.
+ *
+ *  Author: rp <rp@meetrp.com>
+ *
+ */
+
+/* system includes */
+#include <stdio.h>              /* snprintf */
+#include <string.h>             /* strlen, strspn */
+#include <stdlib.h>             /* strtol */
+
+/* our includes */
+#include "common.h"
+#include "config.h"
+#include "mongoq.h"
+
+
+/* locally used */
+#define PART_QNAME_MAX_LEN  64
+#define PART_DEAD_SUFFIX    "dead"
+
+/* round-robin cursor for pushes without a key */
+static unsigned int rr_next = 0;
+
+
+/**
+ * part_qname()
+ *
+ * Build the physical queue name of the partition 'part' of 'qname'
+ *
+ *  qname      - logical queue name
+ *  part       - partition #
+ *  pname      - physical queue name is returned here
+ *  pname_len  - size of 'pname'
+ *
+ **/
+static mq_err_t
+part_qname(const char *qname, int part, char *pname, int pname_len)
+{
+    int len = 0;
+
+    if (1 == MQ_QUEUE_PARTITIONS)
+        len = snprintf(pname, pname_len, "%s", qname);
+    else
+        len = snprintf(pname, pname_len, "%s.p%d", qname, part);
+
+    if (len < 0 || len >= pname_len) {
+        mqerr("qname is too long: %s", qname);
+        return MQ_DB_QNAME_TOO_LONG;
+    }
+
+    return MQ_OK;
+}
+
+
+/**
+ * part_push()
+ *
+ * Push the 'val' into one of the partitions of the queue 'qname'. If a 'key'
+ * is given then all the values with the same key go into the same partition,
+ * else the partitions are picked in a round-robin fashion.
+ *
+ *  conn       - mongo db connection object
+ *  qname      - name of the logical queue into which data is queued
+ *  key        - optional partitioning key (can be NULL)
+ *  val        - string formatted data to be pushed
+ *  delay_ms   - the data is not visible to pops for these many milli secs
+ *  max_deliveries - # of leases after which the data is a dead letter
+ *  tr         - trace of the request (can be NULL)
+ *
+ **/
+mq_err_t
+part_push(mongo *conn, const char *qname, const char *key, const char *val,
+          unsigned int delay_ms, unsigned int max_deliveries, mq_trace_t *tr)
+{
+    mq_err_t ret_code = MQ_ERR;
+    char pname[PART_QNAME_MAX_LEN];
+    int part = 0;
+
+    if (NULL != key && '\0' != key[0])
+        part = djb2_hash(key) % MQ_QUEUE_PARTITIONS;
+    else
+        part = __sync_fetch_and_add(&rr_next, 1) % MQ_QUEUE_PARTITIONS;
+
+    ret_code = part_qname(qname, part, pname, sizeof(pname));
+    if (MQ_OK != ret_code)
+        goto end;
+
+    mqdbg("pushing into partition #%d of %s", part, qname);
+    ret_code = db_push(conn, pname, val, delay_ms, max_deliveries, tr);
+
+end:
+    return ret_code;
+}
+
+
+/**
+ * part_pop()
+ *
+ * Pop from the queue 'qname' into 'val'. Each worker starts with its own
+ * partition (worker # modulo partitions) & steals from the other partitions
+ * only when the local one is empty.
+ *
+ *  conn       - mongo db connection object
+ *  worker_id  - worker # of the caller
+ *  qname      - name of the logical queue from where data is poped.
+ *  val        - string formatted data that is returned. If all partitions
+ *               are empty then '\0' is returned.
+ *  tr         - trace of the request (can be NULL)
+ *
+ **/
+mq_err_t
+part_pop(mongo *conn, int worker_id, const char *qname, char *val,
+         mq_trace_t *tr)
+{
+    mq_err_t ret_code = MQ_ERR;
+    char pname[PART_QNAME_MAX_LEN];
+    int i = 0, part = 0;
+
+    val[0] = '\0';
+    for (; i < MQ_QUEUE_PARTITIONS; i++) {
+        part = (worker_id + i) % MQ_QUEUE_PARTITIONS;
+
+        ret_code = part_qname(qname, part, pname, sizeof(pname));
+        if (MQ_OK != ret_code)
+            break;
+
+        ret_code = db_pop(conn, pname, val, tr);
+        if (MQ_OK != ret_code || '\0' != val[0]) {
+            if (i)
+                mqdbg("worker #%d stole from partition #%d of %s",
+                        worker_id, part, qname);
+            break;
+        }
+    }
+
+    return ret_code;
+}
+
+
+/**
+ * part_lease()
+ *
+ * Lease from the queue 'qname', with the same partition affinity as
+ * part_pop(). The returned id is <partition #>-<id from db_lease()>.
+ *
+ *  conn       - mongo db connection object
+ *  worker_id  - worker # of the caller
+ *  qname      - name of the logical queue from where data is leased
+ *  lease_ms   - the data is hidden from other pops for these many milli secs
+ *  val        - string formatted data that is returned. If all partitions
+ *               are empty then '\0' is returned.
+ *  id         - id to ack the message with is returned here; MQ_MSG_ID_LEN
+ *               long
+ *  deliveries - # of times the message has been leased, including this one
+ *  tr         - trace of the request (can be NULL)
+ *
+ **/
+mq_err_t
+part_lease(mongo *conn, int worker_id, const char *qname,
+           unsigned int lease_ms, char *val, char *id, int *deliveries,
+           mq_trace_t *tr)
+{
+    mq_err_t ret_code = MQ_ERR;
+    char pname[PART_QNAME_MAX_LEN];
+    char oid[MQ_MSG_ID_LEN];
+    int i = 0, part = 0;
+
+    val[0] = id[0] = '\0';
+    for (; i < MQ_QUEUE_PARTITIONS; i++) {
+        part = (worker_id + i) % MQ_QUEUE_PARTITIONS;
+
+        ret_code = part_qname(qname, part, pname, sizeof(pname));
+        if (MQ_OK != ret_code)
+            break;
+
+        ret_code = db_lease(conn, pname, lease_ms, val, oid, deliveries, tr);
+        if (MQ_OK != ret_code)
+            break;
+
+        if ('\0' != val[0]) {
+            /* <24 hex chars>-<upto 19 digits> */
+            snprintf(id, MQ_MSG_ID_LEN, "%d-%.44s", part, oid);
+            break;
+        }
+    }
+
+    return ret_code;
+}
+
+
+/**
+ * part_ack()
+ *
+ * Ack a message leased by part_lease()
+ *
+ *  conn       - mongo db connection object
+ *  qname      - name of the logical queue the message was leased from
+ *  id         - id returned by part_lease()
+ *
+ **/
+mq_err_t
+part_ack(mongo *conn, const char *qname, const char *id)
+{
+    mq_err_t ret_code = MQ_ERR;
+    char pname[PART_QNAME_MAX_LEN];
+    char *oid = NULL;
+    long part = strtol(id, &oid, 10);
+
+    /* <partition #>-<24 hex chars>-<end of the lease, upto 18 digits> */
+    if (oid == id || '-' != *oid || part < 0 ||
+            part >= MQ_QUEUE_PARTITIONS ||
+            strspn(++oid, "0123456789abcdef") != 24 || '-' != oid[24] ||
+            strspn(oid + 25, "0123456789") != strlen(oid + 25) ||
+            0 == strlen(oid + 25) || 18 < strlen(oid + 25)) {
+        mqerr("invalid id: %s", id);
+        return MQ_DB_MSG_ID_INVALID;
+    }
+
+    ret_code = part_qname(qname, part, pname, sizeof(pname));
+    if (MQ_OK != ret_code)
+        return ret_code;
+
+    return db_ack(conn, pname, oid);
+}
+
+
+/**
+ * part_sweep()
+ *
+ * Move a batch of dead letters from each partition of 'qname' to its dead
+ * letter queue, <qname>.dead
+ *
+ *  conn       - mongo db connection object
+ *  qname      - name of the logical queue
+ *
+ **/
+mq_err_t
+part_sweep(mongo *conn, const char *qname)
+{
+    mq_err_t ret_code = MQ_OK;
+    char pname[PART_QNAME_MAX_LEN];
+    char dname[PART_QNAME_MAX_LEN];
+    int i = 0, moved = 0;
+
+    if (PART_QNAME_MAX_LEN <= snprintf(dname, sizeof(dname), "%s.%s", qname,
+                                       PART_DEAD_SUFFIX))
+        return MQ_DB_QNAME_TOO_LONG;
+
+    for (; i < MQ_QUEUE_PARTITIONS && MQ_OK == ret_code; i++) {
+        ret_code = part_qname(qname, i, pname, sizeof(pname));
+        if (MQ_OK == ret_code)
+            ret_code = db_move(conn, pname, dname, true, MQ_DEAD_BATCH,
+                               &moved);
+        if (moved)
+            mqwarn("moved %d dead letters from %s", moved, pname);
+    }
+
+    return ret_code;
+}
+
+
+/**
+ * part_replay()
+ *
+ * Move upto 'limit' dead letters of 'qname' back into its partitions, as
+ * fresh messages, spreading them across the partitions
+ *
+ *  conn       - mongo db connection object
+ *  qname      - name of the logical queue
+ *  limit      - max # of dead letters to be replayed
+ *  replayed   - # of dead letters replayed is returned here
+ *
+ **/
+mq_err_t
+part_replay(mongo *conn, const char *qname, int limit, int *replayed)
+{
+    mq_err_t ret_code = MQ_OK;
+    char pname[PART_QNAME_MAX_LEN];
+    char dname[PART_QNAME_MAX_LEN];
+    int part = 0, want = 0, moved = 0;
+
+    *replayed = 0;
+    if (PART_QNAME_MAX_LEN <= snprintf(dname, sizeof(dname), "%s.%s", qname,
+                                       PART_DEAD_SUFFIX))
+        return MQ_DB_QNAME_TOO_LONG;
+
+    while (*replayed < limit && MQ_OK == ret_code) {
+        part = __sync_fetch_and_add(&rr_next, 1) % MQ_QUEUE_PARTITIONS;
+        want = limit - *replayed;
+        if (want > MQ_DEAD_BATCH)
+            want = MQ_DEAD_BATCH;
+
+        ret_code = part_qname(qname, part, pname, sizeof(pname));
+        if (MQ_OK == ret_code)
+            ret_code = db_move(conn, dname, pname, false, want, &moved);
+
+        *replayed += moved;
+        if (moved < want)
+            break;                  /* the dead letter queue is empty */
+    }
+
+    return ret_code;
+}
+
+
+/**
+ * part_dead_list()
+ *
+ * List upto 'limit' dead letters of 'qname' into 'buf'
+ *
+ *  conn       - mongo db connection object
+ *  qname      - name of the logical queue
+ *  limit      - max # of dead letters to be listed
+ *  buf        - event buffer into which the dead letters are written
+ *
+ **/
+mq_err_t
+part_dead_list(mongo *conn, const char *qname, int limit,
+               struct evbuffer *buf)
+{
+    char dname[PART_QNAME_MAX_LEN];
+
+    if (PART_QNAME_MAX_LEN <= snprintf(dname, sizeof(dname), "%s.%s", qname,
+                                       PART_DEAD_SUFFIX))
+        return MQ_DB_QNAME_TOO_LONG;
+
+    return db_dead_list(conn, dname, limit, buf);
+}
@@ -0,0 +1,792 @@
+/*
+ *  router.c
+ *
+ *  The http front end: routes a request to its queue, dead letter or topic
+ *  handler & replies. Kept apart from main() so that it can be linked, &
+ *  fuzzed, without a server or a db.
+ *
+ *  Author: rp <rp@meetrp.com>
+ *
+ */
+
+/* system includes */
+#include <event.h>              /* libevent.* */
+#include <stdio.h>              /* snprintf */
+#include <string.h>             /* strcmp, strncmp, strpbrk */
+#include <stdlib.h>             /* strtoul, malloc */
+
+/* our includes */
+#include "common.h"
+#include "config.h"
+#include "mongoq.h"
+
+/* URI under which the queues are exposed, i.e., /q/<qname> */
+#define QUEUE_URI_PREFIX        "/q/"
+#define DEAD_URI_PREFIX         "/dead/"
+#define TOPIC_URI_PREFIX        "/t/"
+#define SLOW_LOG_URI            "/admin/slowlog"
+
+/* not among the status codes of libevent */
+#define HTTP_CONFLICT           409
+
+
+/**
+ * send_reply()
+ *
+ * Send the reply with the given code & an optional body
+ *
+ *  req        - http event request structure
+ *  code       - http response code
+ *  reason     - http response reason
+ *  body       - response body (can be NULL)
+ *
+ **/
+void
+send_reply(struct evhttp_request *req, int code, const char *reason,
+           const char *body)
+{
+    struct evbuffer *buf = NULL;
+
+    if (NULL != body) {
+        buf = evbuffer_new();
+        if (NULL == buf) {
+            mqerr("unable to create event buffer");
+            evhttp_send_reply(req, HTTP_SERVUNAVAIL, "Service unavailable",
+                              NULL);
+            return;
+        }
+        evbuffer_add_printf(buf, "%s\n", body);
+    }
+
+    evhttp_send_reply(req, code, reason, buf);
+
+    if (NULL != buf)
+        evbuffer_free(buf);
+}
+
+
+/**
+ * valid_qname()
+ *
+ * A queue name has to be non-empty, upto MQ_MAX_QNAME_LEN long & should
+ * not contain any of the chars that mongo db (or the partitioning, '.')
+ * reserves for itself. The same goes for the topic & the group names.
+ *
+ *  qname      - name of the queue
+ *
+ **/
+static bool
+valid_qname(const char *qname)
+{
+    if ('\0' == qname[0] || MQ_MAX_QNAME_LEN < strlen(qname))
+        return false;
+
+    return (NULL == strpbrk(qname, "./$ ")) ? true : false;
+}
+
+
+/**
+ * query_uint()
+ *
+ * Parse the unsigned int query arg 'name'
+ *
+ *  query      - parsed query string of the request
+ *  name       - name of the query arg
+ *  max        - max value allowed
+ *  def        - default value, if the arg is absent
+ *  out        - the parsed value is returned here
+ *
+ **/
+static bool
+query_uint(struct evkeyvalq *query, const char *name, unsigned int max,
+           unsigned int def, unsigned int *out)
+{
+    const char *str = evhttp_find_header(query, name);
+    char *end = NULL;
+    unsigned long val = 0;
+
+    *out = def;
+    if (NULL == str)
+        return true;
+
+    val = strtoul(str, &end, 10);
+    if ('\0' == str[0] || '\0' != *end || '-' == str[0] || val > max)
+        return false;
+
+    *out = (unsigned int) val;
+    return true;
+}
+
+
+/**
+ * queue_push()
+ *
+ * Handle 'POST /q/<qname>[?key=<key>][&delay=<ms>][&max_deliveries=<n>]'.
+ * The request body is the value, which is not visible to pops until 'delay'
+ * ms have passed & is a dead letter once it has been leased 'n' times.
+ *
+ * With '&dedup=<key>' a retry of the push is replied to as if it went
+ * through, with the X-MQ-Duplicate header, & is not pushed again.
+ *
+ *  req        - http event request structure
+ *  evt        - worker that is handling this request
+ *  qname      - name of the queue
+ *  query      - parsed query string of the request
+ *  tr         - trace of the request
+ *
+ **/
+static void
+queue_push(struct evhttp_request *req, ev_thread_t *evt, const char *qname,
+           struct evkeyvalq *query, mq_trace_t *tr)
+{
+    mq_err_t ret_code = MQ_ERR;
+    char val[MQ_MAX_DATA_LEN];
+    struct evbuffer *in = evhttp_request_get_input_buffer(req);
+    size_t len = evbuffer_get_length(in);
+    const char *dedup = evhttp_find_header(query, "dedup");
+    unsigned int delay_ms = 0;
+    unsigned int max_deliveries = 0;
+    mq_claim_t claim = MQ_CLAIM_NEW;
+    int64_t claim_at = 0;
+
+    if (!query_uint(query, "delay", MQ_MAX_DELAY_MS, 0, &delay_ms)) {
+        send_reply(req, HTTP_BADREQUEST, "Bad Request", "invalid delay");
+        return;
+    }
+
+    if (!query_uint(query, "max_deliveries", MQ_MAX_DELIVERIES_LIMIT,
+                    MQ_MAX_DELIVERIES, &max_deliveries) ||
+            0 == max_deliveries) {
+        send_reply(req, HTTP_BADREQUEST, "Bad Request",
+                   "invalid max_deliveries");
+        return;
+    }
+
+    if (0 == len || MQ_MAX_DATA_LEN <= len) {
+        mqerr("invalid value len(%zu) for queue: %s", len, qname);
+        send_reply(req, HTTP_BADREQUEST, "Bad Request", "invalid value");
+        return;
+    }
+    if (NULL != dedup && '\0' == dedup[0]) {
+        send_reply(req, HTTP_BADREQUEST, "Bad Request", "invalid dedup");
+        return;
+    }
+
+    if (NULL != dedup) {
+        ret_code = dedup_begin(evt->evt_conn, qname, dedup, &claim,
+                               &claim_at, tr);
+        if (MQ_DB_QNAME_TOO_LONG == ret_code) {
+            send_reply(req, HTTP_BADREQUEST, "Bad Request", "invalid dedup");
+            return;
+        }
+        if (MQ_OK != ret_code) {
+            mqerr("dedup of %s failed: %s", qname, MQ_ERR_STR(ret_code));
+            send_reply(req, HTTP_INTERNAL, "Internal Server Error",
+                       MQ_ERR_STR(ret_code));
+            return;
+        }
+        if (MQ_CLAIM_DONE == claim) {
+            evhttp_add_header(evhttp_request_get_output_headers(req),
+                              "X-MQ-Duplicate", "1");
+            send_reply(req, HTTP_OK, "OK", NULL);
+            return;
+        }
+        if (MQ_CLAIM_PENDING == claim) {
+            /* not known yet whether it will be pushed; retried later */
+            evhttp_add_header(evhttp_request_get_output_headers(req),
+                              "Retry-After", "1");
+            send_reply(req, HTTP_SERVUNAVAIL, "Service unavailable",
+                       "push in progress");
+            return;
+        }
+    }
+
+    evbuffer_remove(in, val, len);
+    val[len] = '\0';
+
+    ret_code = part_push(evt->evt_conn, qname,
+                         evhttp_find_header(query, "key"), val, delay_ms,
+                         max_deliveries, tr);
+    if (NULL != dedup)
+        dedup_end(evt->evt_conn, qname, dedup, claim_at,
+                  (MQ_OK == ret_code), tr);
+    if (MQ_OK != ret_code) {
+        mqerr("push into %s failed: %s", qname, MQ_ERR_STR(ret_code));
+        send_reply(req, HTTP_INTERNAL, "Internal Server Error",
+                   MQ_ERR_STR(ret_code));
+        return;
+    }
+
+    send_reply(req, HTTP_OK, "OK", NULL);
+    waiter_notify(evt, qname, delay_ms);
+}
+
+
+/* state of a batch pop being streamed */
+#define BATCH_QNAME_MAX_LEN     64
+
+typedef struct _batch_t {
+    struct evhttp_request *bt_req;      /* NULL once freed by evhttp */
+    ev_thread_t *bt_evt;
+    unsigned int bt_left;               /* # of messages still to pop */
+    bool bt_closed;                     /* client went away */
+    char bt_qname[BATCH_QNAME_MAX_LEN];
+} batch_t;
+
+
+/**
+ * batch_closed()
+ *
+ * The client of a batch pop went away. A request still on the connection
+ * is freed along with it; one that evhttp has already let go of is ours to
+ * free, by the next slice.
+ *
+ *  evcon      - http connection being closed
+ *  arg        - batch_t of the pop
+ *
+ **/
+static void
+batch_closed(struct evhttp_connection *evcon, void *arg)
+{
+    batch_t *bt = (batch_t *) arg;
+
+    bt->bt_closed = true;
+    if (NULL != evhttp_request_get_connection(bt->bt_req))
+        bt->bt_req = NULL;
+}
+
+
+/**
+ * batch_slice()
+ *
+ * Pop upto MQ_BATCH_SLICE messages & send them as a chunk, each as
+ * '<len> <val>\n'. The next slice is run in the next event loop iteration,
+ * so that a large batch does not hold up the other connections.
+ *
+ *  fd         - unused
+ *  what       - unused
+ *  arg        - batch_t of the pop
+ *
+ **/
+static void
+batch_slice(evutil_socket_t fd, short what, void *arg)
+{
+    batch_t *bt = (batch_t *) arg;
+    ev_thread_t *evt = bt->bt_evt;
+    mq_err_t ret_code = MQ_ERR;
+    struct evbuffer *buf = NULL;
+    struct timeval now = {0, 0};
+    char val[MQ_MAX_DATA_LEN];
+    int i = 0;
+
+    if (bt->bt_closed) {
+        /* frees the request, as it is no longer on a connection */
+        if (NULL != bt->bt_req)
+            evhttp_send_reply_end(bt->bt_req);
+        goto done;
+    }
+
+    buf = evbuffer_new();
+    if (NULL == buf) {
+        mqerr("unable to create event buffer");
+        bt->bt_left = 0;
+    }
+
+    for (; NULL != buf && i < MQ_BATCH_SLICE && bt->bt_left > 0; i++) {
+        ret_code = part_pop(evt->evt_conn, evt->evt_id, bt->bt_qname, val,
+                            NULL);
+        if (MQ_OK != ret_code)
+            mqerr("pop from %s failed: %s", bt->bt_qname,
+                    MQ_ERR_STR(ret_code));
+        if (MQ_OK != ret_code || '\0' == val[0]) {
+            bt->bt_left = 0;
+            break;
+        }
+
+        evbuffer_add_printf(buf, "%zu %s\n", strlen(val), val);
+        bt->bt_left--;
+    }
+
+    if (NULL != buf) {
+        if (0 != evbuffer_get_length(buf))
+            evhttp_send_reply_chunk(bt->bt_req, buf);
+        evbuffer_free(buf);
+    }
+
+    if (bt->bt_left > 0 &&
+            0 == event_base_once(evt->evt_base, -1, EV_TIMEOUT, batch_slice,
+                                 bt, &now))
+        return;
+
+    evhttp_connection_set_closecb(evhttp_request_get_connection(bt->bt_req),
+                                  NULL, NULL);
+    evhttp_send_reply_end(bt->bt_req);
+done:
+    free(bt);
+}
+
+
+/**
+ * queue_pop_batch()
+ *
+ * Handle 'GET /q/<qname>?count=<n>'. Pops upto 'n' messages, streamed in a
+ * chunked reply that ends when 'n' are popped or the queue is empty.
+ *
+ *  req        - http event request structure
+ *  evt        - worker that is handling this request
+ *  qname      - name of the queue
+ *  count      - max # of messages to pop
+ *
+ **/
+static void
+queue_pop_batch(struct evhttp_request *req, ev_thread_t *evt,
+                const char *qname, unsigned int count)
+{
+    batch_t *bt = NULL;
+
+    if (BATCH_QNAME_MAX_LEN <= strlen(qname)) {
+        send_reply(req, HTTP_BADREQUEST, "Bad Request", "invalid queue name");
+        return;
+    }
+
+    bt = (batch_t *)malloc(sizeof(batch_t));
+    if (NULL == bt) {
+        mqerr("malloc failed for %zu bytes", sizeof(batch_t));
+        send_reply(req, HTTP_SERVUNAVAIL, "Service unavailable", NULL);
+        return;
+    }
+
+    bt->bt_req = req;
+    bt->bt_evt = evt;
+    bt->bt_left = count;
+    bt->bt_closed = false;
+    strcpy(bt->bt_qname, qname);
+
+    evhttp_connection_set_closecb(evhttp_request_get_connection(req),
+                                  batch_closed, bt);
+    evhttp_send_reply_start(req, HTTP_OK, "OK");
+    batch_slice(-1, 0, bt);
+}
+
+
+/**
+ * queue_pop()
+ *
+ * Handle 'GET /q/<qname>[?wait=<ms>]'. Replies with 204 if the queue is
+ * empty, after waiting for upto 'wait' ms for a message to show up.
+ *
+ * With 'GET /q/<qname>?lease=<ms>' the message is leased rather than
+ * removed; its id & # of deliveries are replied in the X-MQ-Id &
+ * X-MQ-Deliveries headers & it has to be acked within 'lease' ms.
+ *
+ * With 'GET /q/<qname>?count=<n>' upto 'n' messages are popped; see
+ * queue_pop_batch().
+ *
+ *  req        - http event request structure
+ *  evt        - worker that is handling this request
+ *  qname      - name of the queue
+ *  query      - parsed query string of the request
+ *  tr         - trace of the request
+ *
+ **/
+static void
+queue_pop(struct evhttp_request *req, ev_thread_t *evt, const char *qname,
+          struct evkeyvalq *query, mq_trace_t *tr)
+{
+    mq_err_t ret_code = MQ_ERR;
+    char val[MQ_MAX_DATA_LEN];
+    char id[MQ_MSG_ID_LEN];
+    char deliveries_str[16];
+    int deliveries = 0;
+    unsigned int wait_ms = 0;
+    unsigned int lease_ms = 0;
+    unsigned int count = 0;
+
+    if (!query_uint(query, "wait", MQ_MAX_WAIT_MS, 0, &wait_ms)) {
+        send_reply(req, HTTP_BADREQUEST, "Bad Request", "invalid wait");
+        return;
+    }
+
+    /* waiters do plain pops; a lease does not wait */
+    if (!query_uint(query, "lease", MQ_MAX_LEASE_MS, 0, &lease_ms) ||
+            (0 != lease_ms && 0 != wait_ms)) {
+        send_reply(req, HTTP_BADREQUEST, "Bad Request", "invalid lease");
+        return;
+    }
+
+    /* a batch neither waits nor leases */
+    if (!query_uint(query, "count", MQ_MAX_BATCH, 0, &count) ||
+            (0 != count && (0 != lease_ms || 0 != wait_ms))) {
+        send_reply(req, HTTP_BADREQUEST, "Bad Request", "invalid count");
+        return;
+    }
+
+    if (0 != count) {
+        queue_pop_batch(req, evt, qname, count);
+        return;
+    }
+
+    if (0 != lease_ms) {
+        dead_track(evt, qname);
+        ret_code = part_lease(evt->evt_conn, evt->evt_id, qname, lease_ms,
+                              val, id, &deliveries, tr);
+        if (MQ_OK == ret_code && '\0' != val[0]) {
+            snprintf(deliveries_str, sizeof(deliveries_str), "%d",
+                     deliveries);
+            evhttp_add_header(evhttp_request_get_output_headers(req),
+                              "X-MQ-Id", id);
+            evhttp_add_header(evhttp_request_get_output_headers(req),
+                              "X-MQ-Deliveries", deliveries_str);
+
+            /* it is visible again when the lease is over, unless acked */
+            waiter_notify(evt, qname, lease_ms);
+        }
+    } else {
+        ret_code = part_pop(evt->evt_conn, evt->evt_id, qname, val, tr);
+    }
+    if (MQ_OK != ret_code) {
+        mqerr("pop from %s failed: %s", qname, MQ_ERR_STR(ret_code));
+        send_reply(req, HTTP_INTERNAL, "Internal Server Error",
+                   MQ_ERR_STR(ret_code));
+        return;
+    }
+
+    if ('\0' != val[0]) {
+        send_reply(req, HTTP_OK, "OK", val);
+        return;
+    }
+
+    /* the trace of a parked pop ends here, not when it is woken up */
+    if (0 == wait_ms || MQ_OK != waiter_park(evt, req, qname, wait_ms))
+        send_reply(req, HTTP_NOCONTENT, "No Content", NULL);
+}
+
+
+/**
+ * queue_ack()
+ *
+ * Handle 'DELETE /q/<qname>?id=<id>', the ack of a leased message
+ *
+ *  req        - http event request structure
+ *  evt        - worker that is handling this request
+ *  qname      - name of the queue
+ *  query      - parsed query string of the request
+ *  tr         - trace of the request
+ *
+ **/
+static void
+queue_ack(struct evhttp_request *req, ev_thread_t *evt, const char *qname,
+          struct evkeyvalq *query, mq_trace_t *tr)
+{
+    mq_err_t ret_code = MQ_ERR;
+    const char *id = evhttp_find_header(query, "id");
+
+    if (NULL == id) {
+        send_reply(req, HTTP_BADREQUEST, "Bad Request", "missing id");
+        return;
+    }
+
+    trace_mark(tr, MQ_STAGE_DB_SEND);
+    ret_code = part_ack(evt->evt_conn, qname, id);
+    trace_mark(tr, MQ_STAGE_DB_REPLY);
+    if (MQ_DB_MSG_ID_INVALID == ret_code) {
+        send_reply(req, HTTP_BADREQUEST, "Bad Request", "invalid id");
+        return;
+    }
+    if (MQ_DB_MSG_NOT_LEASED == ret_code) {
+        /* leased again, acked already or a dead letter by now */
+        send_reply(req, HTTP_CONFLICT, "Conflict", "lease is over");
+        return;
+    }
+    if (MQ_OK != ret_code) {
+        mqerr("ack in %s failed: %s", qname, MQ_ERR_STR(ret_code));
+        send_reply(req, HTTP_INTERNAL, "Internal Server Error",
+                   MQ_ERR_STR(ret_code));
+        return;
+    }
+
+    send_reply(req, HTTP_OK, "OK", NULL);
+}
+
+
+/**
+ * dead_letters()
+ *
+ * Handle 'GET /dead/<qname>[?limit=<n>]', which lists the dead letters of
+ * the queue, & 'POST /dead/<qname>[?limit=<n>]', which replays them into
+ * the queue as fresh messages.
+ *
+ *  req        - http event request structure
+ *  evt        - worker that is handling this request
+ *  qname      - name of the queue
+ *  query      - parsed query string of the request
+ *
+ **/
+static void
+dead_letters(struct evhttp_request *req, ev_thread_t *evt, const char *qname,
+             struct evkeyvalq *query)
+{
+    mq_err_t ret_code = MQ_ERR;
+    struct evbuffer *buf = NULL;
+    unsigned int limit = 0;
+    int replayed = 0;
+
+    if (!query_uint(query, "limit", MQ_DEAD_BATCH * MQ_QUEUE_PARTITIONS,
+                    MQ_DEAD_BATCH, &limit) || 0 == limit) {
+        send_reply(req, HTTP_BADREQUEST, "Bad Request", "invalid limit");
+        return;
+    }
+
+    buf = evbuffer_new();
+    if (NULL == buf) {
+        mqerr("unable to create event buffer");
+        evhttp_send_reply(req, HTTP_SERVUNAVAIL, "Service unavailable", NULL);
+        return;
+    }
+
+    if (EVHTTP_REQ_POST == evhttp_request_get_command(req)) {
+        ret_code = part_replay(evt->evt_conn, qname, limit, &replayed);
+        evbuffer_add_printf(buf, "%d\n", replayed);
+        if (0 < replayed)
+            waiter_notify(evt, qname, 0);
+    } else {
+        ret_code = part_dead_list(evt->evt_conn, qname, limit, buf);
+    }
+
+    if (MQ_OK != ret_code) {
+        mqerr("dead letters of %s failed: %s", qname, MQ_ERR_STR(ret_code));
+        send_reply(req, HTTP_INTERNAL, "Internal Server Error",
+                   MQ_ERR_STR(ret_code));
+    } else {
+        evhttp_send_reply(req, HTTP_OK, "OK", buf);
+    }
+    evbuffer_free(buf);
+}
+
+
+/**
+ * topic_push()
+ *
+ * Handle 'POST /t/<topic>'. The request body is the value, which is stored
+ * once & popped by every consumer group. Its seq # is replied in the
+ * X-MQ-Seq header.
+ *
+ *  req        - http event request structure
+ *  evt        - worker that is handling this request
+ *  topic      - name of the topic
+ *  tr         - trace of the request
+ *
+ **/
+static void
+topic_push(struct evhttp_request *req, ev_thread_t *evt, const char *topic,
+           mq_trace_t *tr)
+{
+    mq_err_t ret_code = MQ_ERR;
+    char val[MQ_MAX_DATA_LEN];
+    char seq_str[24];
+    struct evbuffer *in = evhttp_request_get_input_buffer(req);
+    size_t len = evbuffer_get_length(in);
+    int64_t seq = 0;
+
+    if (0 == len || MQ_MAX_DATA_LEN <= len) {
+        mqerr("invalid value len(%zu) for topic: %s", len, topic);
+        send_reply(req, HTTP_BADREQUEST, "Bad Request", "invalid value");
+        return;
+    }
+    evbuffer_remove(in, val, len);
+    val[len] = '\0';
+
+    topic_track(evt, topic);
+    ret_code = db_topic_push(evt->evt_conn, topic, val, &seq, tr);
+    if (MQ_OK != ret_code) {
+        mqerr("push into topic %s failed: %s", topic, MQ_ERR_STR(ret_code));
+        send_reply(req, HTTP_INTERNAL, "Internal Server Error",
+                   MQ_ERR_STR(ret_code));
+        return;
+    }
+
+    snprintf(seq_str, sizeof(seq_str), "%lld", (long long) seq);
+    evhttp_add_header(evhttp_request_get_output_headers(req), "X-MQ-Seq",
+                      seq_str);
+    send_reply(req, HTTP_OK, "OK", NULL);
+}
+
+
+/**
+ * topic_pop()
+ *
+ * Handle 'GET /t/<topic>?group=<group>'. Pops the next message for the
+ * consumer group, moving only its offset; replies with 204 if the group
+ * has consumed all of the topic. The seq # of the message is replied in
+ * the X-MQ-Seq header.
+ *
+ *  req        - http event request structure
+ *  evt        - worker that is handling this request
+ *  topic      - name of the topic
+ *  query      - parsed query string of the request
+ *  tr         - trace of the request
+ *
+ **/
+static void
+topic_pop(struct evhttp_request *req, ev_thread_t *evt, const char *topic,
+          struct evkeyvalq *query, mq_trace_t *tr)
+{
+    mq_err_t ret_code = MQ_ERR;
+    char val[MQ_MAX_DATA_LEN];
+    char seq_str[24];
+    const char *group = evhttp_find_header(query, "group");
+    int64_t seq = 0;
+
+    if (NULL == group || !valid_qname(group)) {
+        send_reply(req, HTTP_BADREQUEST, "Bad Request", "invalid group");
+        return;
+    }
+
+    topic_track(evt, topic);
+    ret_code = db_topic_pop(evt->evt_conn, topic, group, val, &seq, tr);
+    if (MQ_OK != ret_code) {
+        mqerr("pop from topic %s for %s failed: %s", topic, group,
+                MQ_ERR_STR(ret_code));
+        send_reply(req, HTTP_INTERNAL, "Internal Server Error",
+                   MQ_ERR_STR(ret_code));
+        return;
+    }
+
+    if ('\0' == val[0]) {
+        send_reply(req, HTTP_NOCONTENT, "No Content", NULL);
+        return;
+    }
+
+    snprintf(seq_str, sizeof(seq_str), "%lld", (long long) seq);
+    evhttp_add_header(evhttp_request_get_output_headers(req), "X-MQ-Seq",
+                      seq_str);
+    send_reply(req, HTTP_OK, "OK", val);
+}
+
+
+/**
+ * admin_slowlog()
+ *
+ * Handle 'GET /admin/slowlog' by dumping the slow request log
+ *
+ *  req        - http event request structure
+ *
+ **/
+static void
+admin_slowlog(struct evhttp_request *req)
+{
+    struct evbuffer *buf = evbuffer_new();
+    if (NULL == buf) {
+        mqerr("unable to create event buffer");
+        evhttp_send_reply(req, HTTP_SERVUNAVAIL, "Service unavailable", NULL);
+        return;
+    }
+
+    trace_dump(buf);
+    evhttp_send_reply(req, HTTP_OK, "OK", buf);
+    evbuffer_free(buf);
+}
+
+
+/**
+ * event_handler()
+ *
+ * Called when an http event happens on the port. Routes the request to
+ * the queue & topic handlers, tracing it along the way.
+ *
+ *  req        - http event request structure
+ *  arg        - worker (ev_thread_t) that was passed while setting up the
+ *               event
+ *
+ **/
+void
+event_handler(struct evhttp_request *req, void *arg)
+{
+    ev_thread_t *evt = (ev_thread_t *) arg;
+    struct evhttp_uri *uri = NULL;
+    struct evkeyvalq query;
+    const char *path = NULL;
+    const char *qstr = NULL;
+    const char *qname = NULL;
+    bool dead = false;
+    bool topic = false;
+    mq_trace_t tr;
+
+    trace_begin(&tr);
+    mqdbg("worker #%d request #%lu: %s", evt->evt_id, tr.tr_id,
+            evhttp_request_get_uri(req));
+
+    uri = evhttp_uri_parse(evhttp_request_get_uri(req));
+    if (NULL == uri) {
+        send_reply(req, HTTP_BADREQUEST, "Bad Request", "invalid uri");
+        trace_end(&tr);
+        return;
+    }
+
+    /* initializes 'query' even when the uri has no query string */
+    qstr = evhttp_uri_get_query(uri);
+    evhttp_parse_query_str((NULL != qstr) ? qstr : "", &query);
+
+    path = evhttp_uri_get_path(uri);
+    if (NULL != path && 0 == strcmp(path, SLOW_LOG_URI)) {
+        trace_mark(&tr, MQ_STAGE_PARSE);
+        admin_slowlog(req);
+        goto end;
+    }
+
+    if (NULL != path &&
+            0 == strncmp(path, QUEUE_URI_PREFIX, strlen(QUEUE_URI_PREFIX))) {
+        qname = path + strlen(QUEUE_URI_PREFIX);
+    } else if (NULL != path &&
+            0 == strncmp(path, DEAD_URI_PREFIX, strlen(DEAD_URI_PREFIX))) {
+        qname = path + strlen(DEAD_URI_PREFIX);
+        dead = true;
+    } else if (NULL != path &&
+            0 == strncmp(path, TOPIC_URI_PREFIX, strlen(TOPIC_URI_PREFIX))) {
+        qname = path + strlen(TOPIC_URI_PREFIX);
+        topic = true;
+    } else {
+        send_reply(req, HTTP_NOTFOUND, "Not Found", NULL);
+        goto end;
+    }
+
+    if (!valid_qname(qname)) {
+        send_reply(req, HTTP_BADREQUEST, "Bad Request", "invalid queue name");
+        goto end;
+    }
+    tr.tr_qname = qname;
+    trace_mark(&tr, MQ_STAGE_PARSE);
+
+    switch (evhttp_request_get_command(req)) {
+        case EVHTTP_REQ_POST:
+            if (topic)
+                topic_push(req, evt, qname, &tr);
+            else if (dead)
+                dead_letters(req, evt, qname, &query);
+            else
+                queue_push(req, evt, qname, &query, &tr);
+            break;
+        case EVHTTP_REQ_GET:
+            if (topic)
+                topic_pop(req, evt, qname, &query, &tr);
+            else if (dead)
+                dead_letters(req, evt, qname, &query);
+            else
+                queue_pop(req, evt, qname, &query, &tr);
+            break;
+        case EVHTTP_REQ_DELETE:
+            if (!dead && !topic) {
+                queue_ack(req, evt, qname, &query, &tr);
+                break;
+            }
+            /* fall through */
+        default:
+            send_reply(req, HTTP_BADMETHOD, "Method Not Allowed", NULL);
+            break;
+    }
+
+end:
+    trace_end(&tr);
+    evhttp_clear_headers(&query);
+    evhttp_uri_free(uri);
+}
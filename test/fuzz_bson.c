@@ -0,0 +1,218 @@
+/*
+ *  fuzz_bson.c
+ *
+ *  libFuzzer target of the decoding of the messages read from mongo db,
+ *  db_reply_msg() & db_msg_decode() of mdb.c, shared by db_pop(),
+ *  db_lease() & db_topic_pop(). The input is not taken as raw BSON, which
+ *  the driver trusts the server for, but drives the building of a valid
+ *  findAndModify like reply, {ok, value: {...}}, whose fields have the
+ *  names the decoder looks for & whatever types & values the input picks.
+ *
+ *  Author: rp <rp@meetrp.com>
+ *
+ */
+
+/* system includes */
+#include <stdio.h>              /* fprintf, snprintf */
+#include <stdlib.h>             /* abort */
+#include <string.h>             /* memcpy, memchr, memset, strcmp */
+
+/* our includes */
+#include "common.h"
+#include "config.h"
+#include "mongoq.h"
+
+
+/* locally used */
+#define FUZZ_MAX_FIELDS     16
+
+static const char *keys[] = {
+    "_id", "val", "deliveries", "max_deliveries", "pushed_at", "visible_at",
+    "x", ""
+};
+
+typedef struct _fuzz_in_t {
+    const uint8_t *fi_data;
+    size_t fi_len;
+} fuzz_in_t;
+
+/* what the built message has, for the checks of the decoding */
+typedef struct _fuzz_expect_t {
+    bool fe_val;                /* a string "val" */
+    bool fe_oid;                /* an object id "_id" */
+    bool fe_bounded;            /* any "max_deliveries" */
+} fuzz_expect_t;
+
+
+/* mdb.c logs through this; nothing is written out */
+void
+mq_log(const char *log_level, const char *fname, const char *func,
+       int lineno, const char *fmt, ...)
+{
+}
+
+
+/**
+ * take()
+ *
+ * Consume up to 'len' bytes of the input into 'buf'; zero filled past the
+ * end of the input
+ *
+ **/
+static void
+take(fuzz_in_t *in, void *buf, size_t len)
+{
+    size_t n = (len < in->fi_len) ? len : in->fi_len;
+
+    memset(buf, 0, len);
+    memcpy(buf, in->fi_data, n);
+    in->fi_data += n;
+    in->fi_len -= n;
+}
+
+
+/**
+ * take_byte()
+ *
+ * Consume a byte of the input; 0 past its end
+ *
+ **/
+static uint8_t
+take_byte(fuzz_in_t *in)
+{
+    uint8_t b = 0;
+
+    take(in, &b, 1);
+    return b;
+}
+
+
+/**
+ * append_field()
+ *
+ * Append a field, of the name & type picked by the input, to the message
+ * being built & note what the decoder should make of it
+ *
+ *  in         - fuzz input
+ *  b          - message being built
+ *  fe         - expectations
+ *
+ **/
+static void
+append_field(fuzz_in_t *in, bson *b, fuzz_expect_t *fe)
+{
+    const char *key = keys[take_byte(in) % (sizeof(keys) / sizeof(keys[0]))];
+    uint8_t type = take_byte(in);
+    char str[256];
+    const char *nul = NULL;
+    bson_oid_t oid;
+    int32_t i32 = 0;
+    int64_t i64 = 0;
+    double dbl = 0;
+    size_t len = 0;
+
+    switch (type % 8) {
+    case 0:
+        len = take_byte(in);
+        take(in, str, len);
+        nul = memchr(str, '\0', len);
+        if (NULL != nul)
+            len = (size_t) (nul - str);
+        bson_append_string_n(b, key, str, (int) len);
+        fe->fe_val |= (0 == strcmp(key, "val"));
+        break;
+    case 1:
+        take(in, &i32, sizeof(i32));
+        bson_append_int(b, key, i32);
+        break;
+    case 2:
+        take(in, &i64, sizeof(i64));
+        bson_append_long(b, key, i64);
+        break;
+    case 3:
+        take(in, &dbl, sizeof(dbl));
+        bson_append_double(b, key, dbl);
+        break;
+    case 4:
+        take(in, &oid, sizeof(oid));
+        bson_append_oid(b, key, &oid);
+        fe->fe_oid |= (0 == strcmp(key, "_id"));
+        break;
+    case 5:
+        bson_append_bool(b, key, type & 0x80);
+        break;
+    case 6:
+        bson_append_null(b, key);
+        break;
+    default:
+        bson_append_start_object(b, key);
+        bson_append_string(b, "val", "nested");
+        bson_append_finish_object(b);
+        break;
+    }
+
+    fe->fe_bounded |= (0 == strcmp(key, "max_deliveries"));
+}
+
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    fuzz_in_t in = { data, size };
+    fuzz_expect_t fe = { false, false, false };
+    char val[MQ_MAX_DATA_LEN];
+    mq_msg_t msg;
+    uint8_t shape = take_byte(&in);
+    int nfields = take_byte(&in) % FUZZ_MAX_FIELDS;
+    bool has_value = false;
+    bool decoded = false;
+    bson doc;
+    bson out;
+
+    /* the message on its own, as db_topic_pop() reads it */
+    bson_init(&doc);
+    while (nfields--)
+        append_field(&in, &doc, &fe);
+    bson_finish(&doc);
+
+    /* & wrapped in a reply, where 'value' may be missing or not a doc */
+    bson_init(&out);
+    bson_append_double(&out, "ok", 1);
+    switch (shape % 4) {
+    case 0:
+        break;
+    case 1:
+        bson_append_null(&out, "value");
+        break;
+    case 2:
+        bson_append_string(&out, "value", "not a doc");
+        break;
+    default:
+        bson_append_bson(&out, "value", &doc);
+        has_value = true;
+        break;
+    }
+    bson_finish(&out);
+
+    decoded = db_reply_msg(&out, &msg);
+    if (decoded != has_value)
+        abort();
+    if (!decoded)
+        db_msg_decode(bson_data(&doc), &msg);
+
+    if ((NULL != msg.mg_val) != fe.fe_val || msg.mg_has_oid != fe.fe_oid ||
+            msg.mg_bounded != fe.fe_bounded) {
+        fprintf(stderr, "decoded val %d oid %d bounded %d\n",
+                NULL != msg.mg_val, msg.mg_has_oid, msg.mg_bounded);
+        abort();
+    }
+
+    /* copied out as the callers do; an overread is left to the sanitizer */
+    if (NULL != msg.mg_val)
+        snprintf(val, sizeof(val), "%s", msg.mg_val);
+
+    bson_destroy(&out);
+    bson_destroy(&doc);
+
+    return 0;
+}
@@ -0,0 +1,184 @@
+/*
+ *  fuzz_main.c
+ *
+ *  Stand in for libFuzzer where clang is not at hand, i.e., with
+ *  'make test FUZZ_ENGINE=replay'. The same command line is taken, i.e.,
+ *  "[-runs=N] <corpus dir|file>...": every input of the corpus is run once
+ *  & then N random mutations of them are. Nothing is written back; a crash
+ *  is left to the sanitizers.
+ *
+ *  Author: rp <rp@meetrp.com>
+ *
+ */
+
+#define _DEFAULT_SOURCE         /* rand_r() with --std=c99 */
+
+/* system includes */
+#include <stdio.h>              /* fopen, fread, snprintf */
+#include <stdint.h>             /* uint8_t */
+#include <stdlib.h>             /* malloc, free, rand_r, strtol */
+#include <string.h>             /* memcpy, memmove, strncmp */
+#include <dirent.h>             /* opendir, readdir */
+#include <sys/stat.h>           /* stat */
+
+
+/* locally used */
+#define FUZZ_MAX_INPUTS     1024
+#define FUZZ_MAX_LEN        4096
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+typedef struct _fuzz_input_t {
+    uint8_t *fi_data;
+    size_t fi_len;
+} fuzz_input_t;
+
+static fuzz_input_t inputs[FUZZ_MAX_INPUTS];
+static int ninputs = 0;
+
+
+/**
+ * load_file()
+ *
+ * Read the file into the next slot of the corpus & run it
+ *
+ *  path       - file name
+ *
+ **/
+static void
+load_file(const char *path)
+{
+    FILE *fp = NULL;
+    uint8_t *data = NULL;
+    size_t len = 0;
+
+    if (FUZZ_MAX_INPUTS <= ninputs)
+        return;
+
+    fp = fopen(path, "rb");
+    if (NULL == fp) {
+        perror(path);
+        return;
+    }
+
+    data = malloc(FUZZ_MAX_LEN);
+    if (NULL != data) {
+        len = fread(data, 1, FUZZ_MAX_LEN, fp);
+        inputs[ninputs].fi_data = data;
+        inputs[ninputs++].fi_len = len;
+        LLVMFuzzerTestOneInput(data, len);
+    }
+    fclose(fp);
+}
+
+
+/**
+ * load_path()
+ *
+ * Load a file, or all the regular files of a dir
+ *
+ *  path       - file or dir name
+ *
+ **/
+static void
+load_path(const char *path)
+{
+    char fname[1024];
+    struct dirent *de = NULL;
+    struct stat st;
+    DIR *dir = NULL;
+
+    if (0 != stat(path, &st)) {
+        perror(path);
+        return;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        load_file(path);
+        return;
+    }
+
+    dir = opendir(path);
+    if (NULL == dir)
+        return;
+
+    while (NULL != (de = readdir(dir))) {
+        if ('.' == de->d_name[0])
+            continue;
+        snprintf(fname, sizeof(fname), "%s/%s", path, de->d_name);
+        load_file(fname);
+    }
+    closedir(dir);
+}
+
+
+/**
+ * mutate()
+ *
+ * Flip, insert or drop a few random bytes of a copy of a corpus input
+ *
+ *  seed       - rand_r() state
+ *  buf        - FUZZ_MAX_LEN long; the mutation is returned here
+ *
+ **/
+static size_t
+mutate(unsigned int *seed, uint8_t *buf)
+{
+    fuzz_input_t *fi = &inputs[rand_r(seed) % ninputs];
+    size_t len = fi->fi_len;
+    int n = 1 + rand_r(seed) % 4;
+    size_t at = 0;
+
+    memcpy(buf, fi->fi_data, len);
+    while (n--) {
+        at = (0 == len) ? 0 : (size_t) rand_r(seed) % len;
+        switch (rand_r(seed) % 3) {
+        case 0:
+            if (0 < len)
+                buf[at] ^= (uint8_t) (1 << (rand_r(seed) % 8));
+            break;
+        case 1:
+            if (len < FUZZ_MAX_LEN) {
+                memmove(buf + at + 1, buf + at, len - at);
+                buf[at] = (uint8_t) rand_r(seed);
+                len++;
+            }
+            break;
+        default:
+            if (0 < len) {
+                memmove(buf + at, buf + at + 1, len - at - 1);
+                len--;
+            }
+            break;
+        }
+    }
+
+    return len;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    static uint8_t buf[FUZZ_MAX_LEN];
+    unsigned int seed = 1;
+    long runs = 0;
+    long i = 0;
+    int j = 1;
+
+    for (; j < argc; j++) {
+        if (0 == strncmp(argv[j], "-runs=", 6))
+            runs = strtol(argv[j] + 6, NULL, 10);
+        else if ('-' != argv[j][0])
+            load_path(argv[j]);
+    }
+
+    for (i = 0; 0 < ninputs && i < runs; i++)
+        LLVMFuzzerTestOneInput(buf, mutate(&seed, buf));
+
+    printf("%s: %d inputs, %ld mutations\n", argv[0], ninputs, i);
+    for (j = 0; j < ninputs; j++)
+        free(inputs[j].fi_data);
+
+    return 0;
+}
@@ -0,0 +1,208 @@
+/*
+ *  fuzz_router.c
+ *
+ *  libFuzzer target of the http router, event_handler() of router.c. An
+ *  input is one request, "<method byte><uri>\n<body>", which is sent over a
+ *  loopback connection to an in-process evhttp that dispatches to
+ *  event_handler(). The queues, the topics & the dedup are replaced by the
+ *  in-memory stubs of test/stubs.c & the long polls by the ones below, so
+ *  that no server & no db are needed. Every request has to be answered, &
+ *  never with a 500.
+ *
+ *  Author: rp <rp@meetrp.com>
+ *
+ */
+
+#define _POSIX_C_SOURCE 200112L /* getsockname() with --std=c99 */
+
+/* system includes */
+#include <stdio.h>              /* fprintf */
+#include <stdlib.h>             /* abort */
+#include <string.h>             /* memchr, memcpy, memset */
+#include <arpa/inet.h>          /* ntohs */
+#include <netinet/in.h>         /* sockaddr_in */
+#include <sys/socket.h>         /* getsockname */
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/buffer.h>
+
+/* our includes */
+#include "common.h"
+#include "config.h"
+#include "mongoq.h"
+#include "test/stubs.h"
+
+
+/* locally used */
+#define FUZZ_URI_LEN        2048
+#define FUZZ_TIMEOUT_SECS   5
+
+static struct event_base *base = NULL;
+static struct evhttp_connection *conn = NULL;
+static ev_thread_t evt;
+
+typedef struct _fuzz_reply_t {
+    int fr_done;
+    int fr_code;
+} fuzz_reply_t;
+
+
+/* the long polls are not fuzzed, see test/park.c */
+mq_err_t
+waiter_park(ev_thread_t *e, struct evhttp_request *req, const char *qname,
+            unsigned int wait_ms)
+{
+    /* not parked; the router answers with a 204 */
+    return MQ_ERR;
+}
+
+void
+waiter_notify(ev_thread_t *e, const char *qname, unsigned int delay_ms)
+{
+}
+
+
+/**
+ * fuzz_done()
+ *
+ * Reply callback of the client side; NULL if the server dropped the
+ * connection without a reply
+ *
+ *  req        - the request, with the reply
+ *  arg        - fuzz_reply_t
+ *
+ **/
+static void
+fuzz_done(struct evhttp_request *req, void *arg)
+{
+    fuzz_reply_t *fr = (fuzz_reply_t *) arg;
+
+    fr->fr_done = 1;
+    fr->fr_code = (NULL == req) ? 0 : evhttp_request_get_response_code(req);
+    event_base_loopbreak(base);
+}
+
+
+/**
+ * fuzz_timeout()
+ *
+ * A request that is not answered in FUZZ_TIMEOUT_SECS is a hang
+ *
+ **/
+static void
+fuzz_timeout(evutil_socket_t fd, short what, void *arg)
+{
+    fprintf(stderr, "no reply in %d secs\n", FUZZ_TIMEOUT_SECS);
+    abort();
+}
+
+
+/**
+ * fuzz_init()
+ *
+ * Start the in-process server on an ephemeral loopback port, with the
+ * same limits as a worker, & connect to it
+ *
+ **/
+static void
+fuzz_init(void)
+{
+    struct evhttp *http = NULL;
+    struct evhttp_bound_socket *bound = NULL;
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+
+    base = event_base_new();
+    http = evhttp_new(base);
+    if (NULL == base || NULL == http)
+        abort();
+
+    evhttp_set_timeout(http, MQ_HTTP_TIMEOUT_SECS);
+    evhttp_set_max_headers_size(http, MQ_HTTP_MAX_HEADERS_LEN);
+    evhttp_set_max_body_size(http, MQ_HTTP_MAX_BODY_LEN);
+    evhttp_set_allowed_methods(http, EVHTTP_REQ_GET | EVHTTP_REQ_POST |
+                               EVHTTP_REQ_DELETE);
+    evhttp_set_gencb(http, event_handler, &evt);
+
+    bound = evhttp_bind_socket_with_handle(http, "127.0.0.1", 0);
+    if (NULL == bound ||
+            0 != getsockname(evhttp_bound_socket_get_fd(bound),
+                             (struct sockaddr *) &sin, &len))
+        abort();
+
+    conn = evhttp_connection_base_new(base, NULL, "127.0.0.1",
+                                      ntohs(sin.sin_port));
+    if (NULL == conn)
+        abort();
+
+    memset(&evt, 0, sizeof(evt));
+    evt.evt_base = base;
+}
+
+
+/**
+ * LLVMFuzzerTestOneInput()
+ *
+ * The first byte picks the method; the rest, up to the first '\n', is the
+ * uri & whatever follows is the body
+ *
+ **/
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static const enum evhttp_cmd_type methods[] = {
+        EVHTTP_REQ_GET, EVHTTP_REQ_POST, EVHTTP_REQ_DELETE, EVHTTP_REQ_PUT
+    };
+    struct evhttp_request *req = NULL;
+    struct event *timeout = NULL;
+    struct timeval tv = { FUZZ_TIMEOUT_SECS, 0 };
+    fuzz_reply_t fr = { 0, 0 };
+    char uri[FUZZ_URI_LEN];
+    const uint8_t *nl = NULL;
+    size_t uri_len = 0;
+    size_t i = 0;
+
+    if (NULL == base)
+        fuzz_init();
+
+    if (size < 2)
+        return 0;
+
+    nl = memchr(data + 1, '\n', size - 1);
+    uri_len = (NULL == nl) ? size - 1 : (size_t) (nl - data - 1);
+    if (0 == uri_len || FUZZ_URI_LEN <= uri_len)
+        return 0;
+
+    /* a request line the client cannot send is not of interest */
+    for (i = 0; i < uri_len; i++)
+        if (data[1 + i] <= ' ' || 0x7f == data[1 + i])
+            return 0;
+    memcpy(uri, data + 1, uri_len);
+    uri[uri_len] = '\0';
+
+    req = evhttp_request_new(fuzz_done, &fr);
+    if (NULL == req)
+        abort();
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Host",
+                      "127.0.0.1");
+    if (NULL != nl)
+        evbuffer_add(evhttp_request_get_output_buffer(req), nl + 1,
+                     size - (size_t) (nl - data) - 1);
+
+    if (0 != evhttp_make_request(conn, req, methods[data[0] % 4], uri))
+        return 0;
+
+    timeout = evtimer_new(base, fuzz_timeout, NULL);
+    evtimer_add(timeout, &tv);
+    while (!fr.fr_done)
+        event_base_loop(base, EVLOOP_ONCE);
+    event_free(timeout);
+
+    /* the stubs do not fail, so neither may the router */
+    if (HTTP_INTERNAL == fr.fr_code) {
+        fprintf(stderr, "%d reply to %s\n", fr.fr_code, uri);
+        abort();
+    }
+
+    return 0;
+}
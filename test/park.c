@@ -0,0 +1,280 @@
+/*
+ *  park.c
+ *
+ *  Test of the long polls of waiter.c, through the http router of an
+ *  in-process evhttp & with the db side stubbed out by test/stubs.c. Pops
+ *  are parked by raw loopback clients, which then go away, keep waiting,
+ *  or pipeline another request behind the parked one. A client that went
+ *  away must not have a message popped for it, a wakeup must serve all
+ *  the waiters it has messages for, & a pipelined request must be served
+ *  after the parked one.
+ *
+ *  Author: rp <rp@meetrp.com>
+ *
+ */
+
+#define _POSIX_C_SOURCE 200112L /* getsockname() with --std=c99 */
+
+/* system includes */
+#include <stdio.h>              /* printf, perror */
+#include <string.h>             /* memset, strlen, strstr */
+#include <unistd.h>             /* close */
+#include <netinet/in.h>         /* sockaddr_in */
+#include <sys/socket.h>         /* socket, connect, send, recv */
+#include <event2/event.h>
+#include <event2/http.h>
+
+/* our includes */
+#include "common.h"
+#include "config.h"
+#include "mongoq.h"
+#include "test/stubs.h"
+
+
+/* locally used */
+#define PARK_QNAME          "park"
+#define PARK_SETTLE_MS      100         /* for the server to catch up */
+#define PARK_WAITERS        3
+#define PARK_REPLY_LEN      4096
+
+#define PARK_POP            "GET /q/" PARK_QNAME " HTTP/1.1\r\n" \
+                            "Host: 127.0.0.1\r\n\r\n"
+#define PARK_POP_WAIT       "GET /q/" PARK_QNAME "?wait=5000 HTTP/1.1\r\n" \
+                            "Host: 127.0.0.1\r\n\r\n"
+
+static struct event_base *base = NULL;
+static ev_thread_t evt;
+static struct sockaddr_in addr;     /* of the server */
+static int failed = 0;
+
+
+/* the one & only worker */
+ev_thread_t*
+thread_workers(int *n)
+{
+    *n = 1;
+    return &evt;
+}
+
+
+/**
+ * settle()
+ *
+ * Run the server for PARK_SETTLE_MS
+ *
+ **/
+static void
+settle(void)
+{
+    struct timeval tv = { 0, PARK_SETTLE_MS * 1000 };
+
+    event_base_loopexit(base, &tv);
+    event_base_dispatch(base);
+}
+
+
+/**
+ * client()
+ *
+ * Connect to the server & send it 'reqs'; the server accepts & reads them
+ * on the next settle()
+ *
+ *  reqs       - the raw requests
+ *
+ **/
+static int
+client(const char *reqs)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0 || 0 != connect(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+            (ssize_t) strlen(reqs) != send(fd, reqs, strlen(reqs), 0)) {
+        perror("client");
+        return -1;
+    }
+    return fd;
+}
+
+
+/**
+ * replies()
+ *
+ * Read what the server has replied to 'fd' so far, without blocking
+ *
+ *  fd         - client socket
+ *  buf        - the replies are returned here, '\0' terminated
+ *  len        - size of 'buf'
+ *
+ **/
+static void
+replies(int fd, char *buf, size_t len)
+{
+    ssize_t n = recv(fd, buf, len - 1, MSG_DONTWAIT);
+
+    buf[(n < 0) ? 0 : n] = '\0';
+}
+
+
+/**
+ * count()
+ *
+ * # of times 'needle' is in 'buf'
+ *
+ **/
+static int
+count(const char *buf, const char *needle)
+{
+    int n = 0;
+
+    for (; NULL != (buf = strstr(buf, needle)); buf += strlen(needle))
+        n++;
+    return n;
+}
+
+
+/**
+ * check()
+ *
+ * Report on a check & count it if failed
+ *
+ **/
+static void
+check(bool ok, const char *what)
+{
+    printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+    if (!ok)
+        failed++;
+}
+
+
+/**
+ * test_gone()
+ *
+ * A client parks a pop & goes away; a message pushed after is left in
+ * the queue for somebody else
+ *
+ **/
+static void
+test_gone(void)
+{
+    int fd = client(PARK_POP_WAIT);
+
+    settle();
+    close(fd);
+    settle();
+
+    stub_msgs = 1;
+    waiter_notify(&evt, PARK_QNAME, 0);
+    settle();
+    check(1 == stub_msgs, "no pop for a waiter that went away");
+    stub_msgs = 0;
+}
+
+
+/**
+ * test_drain()
+ *
+ * PARK_WAITERS clients park pops; a single wakeup for as many messages
+ * serves them all
+ *
+ **/
+static void
+test_drain(void)
+{
+    char buf[PARK_REPLY_LEN];
+    int fds[PARK_WAITERS];
+    int served = 0;
+    int i = 0;
+
+    for (i = 0; i < PARK_WAITERS; i++)
+        fds[i] = client(PARK_POP_WAIT);
+    settle();
+
+    stub_msgs = PARK_WAITERS;
+    waiter_notify(&evt, PARK_QNAME, 0);
+    settle();
+
+    for (i = 0; i < PARK_WAITERS; i++) {
+        replies(fds[i], buf, sizeof(buf));
+        served += count(buf, "HTTP/1.1 200");
+        close(fds[i]);
+    }
+    check(PARK_WAITERS == served && 0 == stub_msgs,
+          "one wakeup serves all the waiters");
+    stub_msgs = 0;
+}
+
+
+/**
+ * test_pipelined()
+ *
+ * A client pipelines a plain pop behind its parked one; it is served,
+ * with a 204, once the parked one is
+ *
+ **/
+static void
+test_pipelined(void)
+{
+    char buf[PARK_REPLY_LEN];
+    int fd = client(PARK_POP_WAIT PARK_POP);
+
+    settle();
+    stub_msgs = 1;
+    waiter_notify(&evt, PARK_QNAME, 0);
+    settle();
+
+    replies(fd, buf, sizeof(buf));
+    check(1 == count(buf, "HTTP/1.1 200") && 1 == count(buf, "HTTP/1.1 204")
+          && strstr(buf, "HTTP/1.1 200") < strstr(buf, "HTTP/1.1 204"),
+          "a pipelined request is served after the parked one");
+    close(fd);
+    stub_msgs = 0;
+}
+
+
+int
+main(void)
+{
+    struct evhttp *http = NULL;
+    struct evhttp_bound_socket *bound = NULL;
+    socklen_t len = sizeof(addr);
+
+    base = event_base_new();
+    http = evhttp_new(base);
+    if (NULL == base || NULL == http) {
+        fprintf(stderr, "unable to create the server\n");
+        return 1;
+    }
+
+    evhttp_set_timeout(http, MQ_HTTP_TIMEOUT_SECS);
+    evhttp_set_allowed_methods(http, EVHTTP_REQ_GET | EVHTTP_REQ_POST |
+                               EVHTTP_REQ_DELETE);
+    evhttp_set_gencb(http, event_handler, &evt);
+
+    bound = evhttp_bind_socket_with_handle(http, "127.0.0.1", 0);
+    if (NULL == bound ||
+            0 != getsockname(evhttp_bound_socket_get_fd(bound),
+                             (struct sockaddr *) &addr, &len)) {
+        fprintf(stderr, "unable to bind the server\n");
+        return 1;
+    }
+
+    memset(&evt, 0, sizeof(evt));
+    evt.evt_base = base;
+    evt.evt_wheel = tw_new(base);
+    if (NULL == evt.evt_wheel || MQ_OK != waiter_init(&evt, base)) {
+        fprintf(stderr, "unable to set up the waiters\n");
+        return 1;
+    }
+
+    test_gone();
+    test_drain();
+    test_pipelined();
+
+    evhttp_free(http);
+    waiter_free(&evt);
+    tw_free(evt.evt_wheel);
+    event_base_free(base);
+
+    return (0 == failed) ? 0 : 1;
+}
@@ -0,0 +1,490 @@
+/*
+ *  stress.c
+ *
+ *  Stress test of the server against the mongo db of config.h. The server
+ *  is run in-process, by thread_init() as mongoq.c does, so that the
+ *  workers, the router, the dedup & the long polls all run under the
+ *  sanitizer. N pusher threads push M unique messages into a fresh queue
+ *  over http, each with an idempotency key, while N popper threads drain
+ *  it, half of them with long polls & half with leases & acks; each thread
+ *  has its own keep-alive connection. Fails if any message is lost or is
+ *  popped more than once. Meant to be built with -fsanitize=thread or
+ *  =address, see 'make test'. The collections of the queue are dropped at
+ *  the end.
+ *
+ *      usage: stress [threads [messages [workers]]]
+ *
+ *  Author: rp <rp@meetrp.com>
+ *
+ */
+
+#define _POSIX_C_SOURCE 200112L /* nanosleep() etc. with --std=c99 */
+
+/* system includes */
+#include <stdio.h>              /* printf, snprintf */
+#include <stdlib.h>             /* calloc, strtol */
+#include <string.h>             /* memset, memcpy, strlen, strncmp, strstr */
+#include <time.h>               /* nanosleep */
+#include <unistd.h>             /* close, getpid */
+#include <pthread.h>            /* pthread_* */
+#include <arpa/inet.h>          /* htons, inet_addr */
+#include <netinet/in.h>         /* sockaddr_in */
+#include <sys/socket.h>         /* socket, connect, send, recv */
+#include <sys/time.h>           /* timeval */
+#include <event2/thread.h>      /* evthread_use_pthreads */
+
+/* our includes */
+#include "common.h"
+#include "config.h"
+#include "mongoq.h"
+
+
+/* locally used */
+#define STRESS_THREADS      4
+#define STRESS_MSGS         10000
+#define STRESS_WORKERS      4
+#define STRESS_MAX_THREADS  64
+#define STRESS_PREFIX       "stress-"
+#define STRESS_QNAME_LEN    32
+#define STRESS_LEASE_MS     60000   /* never expires during the run */
+#define STRESS_WAIT_MS      100     /* long poll of the poppers */
+#define STRESS_IDLE_MS      3000    /* empty for this long once pushed */
+#define STRESS_BACKOFF_MS   1       /* first retry; doubled upto the max */
+#define STRESS_MAX_BACKOFF_MS 1000
+#define STRESS_MAX_RETRIES  10      /* consecutive failures to give up at */
+#define STRESS_IO_SECS      10      /* no reply in this long is a failure */
+#define STRESS_REQ_LEN      (2 * MQ_MAX_DATA_LEN)
+#define STRESS_REPLY_LEN    (MQ_HTTP_MAX_HEADERS_LEN + MQ_MAX_DATA_LEN)
+#define HTTP_CONFLICT       409     /* ack of a lease that is over */
+
+typedef struct _stress_thread_t {
+    pthread_t st_tid;
+    int st_id;
+    int st_fd;                      /* keep-alive connection; -1 if none */
+    int st_failed;                  /* requests given up on */
+    int st_retries;                 /* consecutive failures so far */
+} stress_thread_t;
+
+/* what the server replied to a request */
+typedef struct _stress_reply_t {
+    int sr_code;
+    char sr_val[MQ_MAX_DATA_LEN];
+    char sr_id[MQ_MSG_ID_LEN];      /* X-MQ-Id, of a lease */
+} stress_reply_t;
+
+static char qname[STRESS_QNAME_LEN];
+static int nthreads = STRESS_THREADS;
+static int nmsgs = STRESS_MSGS;
+static int *seen = NULL;            /* times each message was popped */
+static int popped = 0;
+static int foreign = 0;             /* popped values that were not pushed */
+static int pushers_left = 0;
+
+
+/**
+ * http_connect()
+ *
+ * Connect to the server, with STRESS_IO_SECS timeouts on the socket
+ *
+ **/
+static int
+http_connect(void)
+{
+    struct sockaddr_in sin;
+    struct timeval tv = { STRESS_IO_SECS, 0 };
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0)
+        return -1;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(MQ_SERVER_PORT);
+    sin.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if (0 != setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ||
+            0 != setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) ||
+            0 != connect(fd, (struct sockaddr *) &sin, sizeof(sin))) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+/**
+ * http_header()
+ *
+ * Value of the header 'name' in the reply headers 'hdrs', upto its end of
+ * line; NULL if absent
+ *
+ **/
+static const char *
+http_header(const char *hdrs, const char *name)
+{
+    const char *h = strstr(hdrs, name);
+
+    return (NULL == h) ? NULL : h + strlen(name);
+}
+
+
+/**
+ * http_call()
+ *
+ * Send a request over the keep-alive connection of the thread & read its
+ * reply; the connection is made afresh if there is none. Returns false if
+ * the connection failed, in which case it is dropped.
+ *
+ *  st         - thread
+ *  method     - "GET", "POST" or "DELETE"
+ *  uri        - uri of the request
+ *  body       - body of the request; NULL if none
+ *  sr         - reply is returned here
+ *
+ **/
+static bool
+http_call(stress_thread_t *st, const char *method, const char *uri,
+          const char *body, stress_reply_t *sr)
+{
+    char req[STRESS_REQ_LEN];
+    char reply[STRESS_REPLY_LEN];
+    const char *h = NULL;
+    char *end = NULL;
+    size_t len = 0, hdrs_len = 0, body_len = 0;
+    ssize_t n = 0;
+    int req_len = 0;
+
+    memset(sr, 0, sizeof(stress_reply_t));
+    if (st->st_fd < 0 && (st->st_fd = http_connect()) < 0)
+        return false;
+
+    req_len = snprintf(req, sizeof(req), "%s %s HTTP/1.1\r\n"
+                       "Host: 127.0.0.1\r\nContent-Length: %zu\r\n\r\n%s",
+                       method, uri, (NULL == body) ? 0 : strlen(body),
+                       (NULL == body) ? "" : body);
+    if (req_len < 0 || (int) sizeof(req) <= req_len ||
+            req_len != send(st->st_fd, req, req_len, 0))
+        goto failed;
+
+    /* the headers, & whatever of the body comes along */
+    for (;;) {
+        n = recv(st->st_fd, reply + len, sizeof(reply) - len - 1, 0);
+        if (n <= 0)
+            goto failed;
+        len += n;
+        reply[len] = '\0';
+        if (NULL != (end = strstr(reply, "\r\n\r\n")))
+            break;
+        if (sizeof(reply) - 1 == len)
+            goto failed;
+    }
+    hdrs_len = end + 4 - reply;
+    *end = '\0';
+
+    if (1 != sscanf(reply, "HTTP/1.1 %d", &sr->sr_code))
+        goto failed;
+    if (NULL != (h = http_header(reply, "Content-Length: ")))
+        body_len = strtoul(h, NULL, 10);
+    if (NULL != (h = http_header(reply, "X-MQ-Id: ")))
+        sscanf(h, "%63[^\r]", sr->sr_id);
+    if (sizeof(sr->sr_val) <= body_len ||
+            sizeof(reply) - 1 < hdrs_len + body_len)
+        goto failed;
+
+    while (len < hdrs_len + body_len) {
+        n = recv(st->st_fd, reply + len, hdrs_len + body_len - len, 0);
+        if (n <= 0)
+            goto failed;
+        len += n;
+    }
+    memcpy(sr->sr_val, reply + hdrs_len, body_len);
+    sr->sr_val[body_len] = '\0';
+
+    if (NULL != strstr(reply, "Connection: close")) {
+        close(st->st_fd);
+        st->st_fd = -1;
+    }
+    return true;
+
+failed:
+    close(st->st_fd);
+    st->st_fd = -1;
+    return false;
+}
+
+
+/**
+ * backoff()
+ *
+ * A request failed; wait before it is retried, twice as long each time.
+ * Returns false once STRESS_MAX_RETRIES have failed in a row, when the
+ * request is given up on.
+ *
+ *  st         - thread
+ *  what       - what failed, for the report
+ *  sr         - reply, if any
+ *
+ **/
+static bool
+backoff(stress_thread_t *st, const char *what, const stress_reply_t *sr)
+{
+    unsigned int ms = STRESS_BACKOFF_MS << st->st_retries;
+    struct timespec nap;
+
+    if (STRESS_MAX_RETRIES <= ++st->st_retries) {
+        fprintf(stderr, "#%d: giving up on %s, last reply %d: %s\n",
+                st->st_id, what, sr->sr_code, sr->sr_val);
+        st->st_retries = 0;
+        st->st_failed++;
+        return false;
+    }
+
+    if (STRESS_MAX_BACKOFF_MS < ms)
+        ms = STRESS_MAX_BACKOFF_MS;
+    nap.tv_sec = ms / 1000;
+    nap.tv_nsec = (long) (ms % 1000) * 1000000;
+    nanosleep(&nap, NULL);
+    return true;
+}
+
+
+/**
+ * pusher()
+ *
+ * Push the messages st_id, st_id + nthreads, ... A failed push is retried
+ * with the same idempotency key, so that it is not pushed twice.
+ *
+ **/
+static void *
+pusher(void *arg)
+{
+    stress_thread_t *st = (stress_thread_t *) arg;
+    stress_reply_t sr;
+    char uri[STRESS_REQ_LEN];
+    char val[MQ_MAX_DATA_LEN];
+    int i = st->st_id;
+
+    for (; i < nmsgs; i += nthreads) {
+        snprintf(uri, sizeof(uri), "/q/%s?dedup=%d", qname, i);
+        snprintf(val, sizeof(val), STRESS_PREFIX "%d", i);
+        while (!http_call(st, "POST", uri, val, &sr) || HTTP_OK != sr.sr_code)
+            if (!backoff(st, "push", &sr))
+                goto end;
+        st->st_retries = 0;
+    }
+
+end:
+    __sync_fetch_and_sub(&pushers_left, 1);
+    return NULL;
+}
+
+
+/**
+ * record()
+ *
+ * Note a popped message
+ *
+ **/
+static void
+record(const char *val)
+{
+    char *end = NULL;
+    long i = -1;
+
+    if (0 == strncmp(val, STRESS_PREFIX, strlen(STRESS_PREFIX)))
+        i = strtol(val + strlen(STRESS_PREFIX), &end, 10);
+    if (i < 0 || nmsgs <= i || '\0' != *end) {
+        __sync_fetch_and_add(&foreign, 1);
+        return;
+    }
+
+    __sync_fetch_and_add(&seen[i], 1);
+    __sync_fetch_and_add(&popped, 1);
+}
+
+
+/**
+ * popper()
+ *
+ * Pop with a long poll, or lease & ack, until the queue has stayed empty
+ * for STRESS_IDLE_MS after the last push
+ *
+ **/
+static void *
+popper(void *arg)
+{
+    stress_thread_t *st = (stress_thread_t *) arg;
+    stress_reply_t sr;
+    char uri[STRESS_REQ_LEN];
+    char ack_uri[STRESS_REQ_LEN];
+    uint64_t idle_since = 0;
+    bool leases = st->st_id & 1;
+    bool sent = false;
+    bool lost_reply = false;
+
+    if (leases)
+        snprintf(uri, sizeof(uri), "/q/%s?lease=%d", qname, STRESS_LEASE_MS);
+    else
+        snprintf(uri, sizeof(uri), "/q/%s?wait=%d", qname, STRESS_WAIT_MS);
+
+    /* on past the last message too, so that a late duplicate is seen */
+    for (;;) {
+        if (!http_call(st, "GET", uri, NULL, &sr) ||
+                (HTTP_OK != sr.sr_code && HTTP_NOCONTENT != sr.sr_code)) {
+            if (!backoff(st, "pop", &sr))
+                break;
+            continue;
+        }
+        st->st_retries = 0;
+
+        if (HTTP_NOCONTENT == sr.sr_code) {
+            if (0 < __atomic_load_n(&pushers_left, __ATOMIC_ACQUIRE)) {
+                idle_since = 0;
+            } else if (0 == idle_since) {
+                idle_since = mono_ms();
+            } else if (STRESS_IDLE_MS < mono_ms() - idle_since) {
+                break;
+            }
+            continue;
+        }
+
+        idle_since = 0;
+        record(sr.sr_val);
+        if (!leases)
+            continue;
+
+        /* a 409 after a try that got no reply is the ack of that try */
+        snprintf(ack_uri, sizeof(ack_uri), "/q/%s?id=%s", qname, sr.sr_id);
+        for (lost_reply = false;; lost_reply |= !sent) {
+            sent = http_call(st, "DELETE", ack_uri, NULL, &sr);
+            if (sent && (HTTP_OK == sr.sr_code ||
+                         (HTTP_CONFLICT == sr.sr_code && lost_reply)))
+                break;
+            if (!backoff(st, "ack", &sr))
+                break;
+        }
+        st->st_retries = 0;
+    }
+
+    if (0 <= st->st_fd)
+        close(st->st_fd);
+    return NULL;
+}
+
+
+/**
+ * drop_queue()
+ *
+ * Drop the collections of the queue, its partitions & its dead letters
+ *
+ **/
+static void
+drop_queue(void)
+{
+    mongo *conn = NULL;
+    char coll[STRESS_QNAME_LEN + 8];
+    int i = 0;
+
+    if (MQ_OK != db_init(&conn)) {
+        fprintf(stderr, "unable to connect to drop %s\n", qname);
+        return;
+    }
+
+    for (; i <= MQ_QUEUE_PARTITIONS; i++) {
+        if (MQ_QUEUE_PARTITIONS == i)
+            snprintf(coll, sizeof(coll), "%s.dead", qname);
+        else if (1 == MQ_QUEUE_PARTITIONS)
+            snprintf(coll, sizeof(coll), "%s", qname);
+        else
+            snprintf(coll, sizeof(coll), "%s.p%d", qname, i);
+
+        /* fails for the ones never created */
+        mongo_cmd_drop_collection(conn, MONGO_DB_NAME, coll, NULL);
+    }
+
+    db_deinit(conn);
+}
+
+
+int
+main(int argc, char **argv)
+{
+    stress_thread_t pushers[STRESS_MAX_THREADS];
+    stress_thread_t poppers[STRESS_MAX_THREADS];
+    int nworkers = STRESS_WORKERS;
+    int lost = 0;
+    int dups = 0;
+    int failed = 0;
+    int i = 0;
+
+    if (1 < argc)
+        nthreads = (int) strtol(argv[1], NULL, 10);
+    if (2 < argc)
+        nmsgs = (int) strtol(argv[2], NULL, 10);
+    if (3 < argc)
+        nworkers = (int) strtol(argv[3], NULL, 10);
+    if (nthreads < 1 || STRESS_MAX_THREADS < nthreads || nmsgs < 1 ||
+            nworkers < 1) {
+        fprintf(stderr, "usage: %s [threads (1-%d) [messages [workers]]]\n",
+                argv[0], STRESS_MAX_THREADS);
+        return 2;
+    }
+
+    seen = (int *)calloc(nmsgs, sizeof(int));
+    if (NULL == seen) {
+        fprintf(stderr, "calloc failed for %d messages\n", nmsgs);
+        return 1;
+    }
+
+    /* the server, as mongoq.c starts it */
+    if (0 != evthread_use_pthreads() || MQ_OK != dedup_init() ||
+            MQ_OK != thread_init(nworkers, &event_handler)) {
+        fprintf(stderr, "unable to start the server on port %d\n",
+                MQ_SERVER_PORT);
+        return 1;
+    }
+
+    snprintf(qname, sizeof(qname), "stress%d", (int) getpid());
+    printf("%d workers; %d pushers & %d poppers, %d messages into %s\n",
+           nworkers, nthreads, nthreads, nmsgs, qname);
+
+    pushers_left = nthreads;
+    for (i = 0; i < nthreads; i++) {
+        memset(&pushers[i], 0, sizeof(stress_thread_t));
+        memset(&poppers[i], 0, sizeof(stress_thread_t));
+        pushers[i].st_id = poppers[i].st_id = i;
+        pushers[i].st_fd = poppers[i].st_fd = -1;
+        if (0 != pthread_create(&pushers[i].st_tid, NULL, pusher,
+                                &pushers[i]) ||
+                0 != pthread_create(&poppers[i].st_tid, NULL, popper,
+                                    &poppers[i])) {
+            fprintf(stderr, "unable to create thread #%d\n", i);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(pushers[i].st_tid, NULL);
+        pthread_join(poppers[i].st_tid, NULL);
+        if (0 <= pushers[i].st_fd)
+            close(pushers[i].st_fd);
+        failed += pushers[i].st_failed + poppers[i].st_failed;
+    }
+
+    thread_stop();
+    thread_join();
+    drop_queue();
+
+    for (i = 0; i < nmsgs; i++) {
+        if (0 == seen[i])
+            lost++;
+        else if (1 < seen[i])
+            dups++;
+    }
+    free(seen);
+
+    printf("popped %d: %d lost, %d popped more than once, %d unknown, "
+           "%d requests given up on\n", popped, lost, dups, foreign, failed);
+
+    return (0 == lost && 0 == dups && 0 == foreign && 0 == failed) ? 0 : 1;
+}
@@ -0,0 +1,175 @@
+/*
+ *  stubs.c
+ *
+ *  Stubs of everything the router calls beyond trace.c & common.c, other
+ *  than the long polls of waiter.c. They keep a count of the pushed
+ *  messages, so that the pops see both a full & an empty queue, & otherwise
+ *  just succeed, but for the names that mongo db would not take. Shared by
+ *  test/fuzz_router.c & test/park.c.
+ *
+ *  Author: rp <rp@meetrp.com>
+ *
+ */
+
+/* system includes */
+#include <stdio.h>              /* snprintf */
+#include <string.h>             /* strcmp */
+#include <event2/buffer.h>
+
+/* our includes */
+#include "common.h"
+#include "config.h"
+#include "mongoq.h"
+#include "test/stubs.h"
+
+
+/* locally used */
+#define STUB_NAME_SPC_MAX_LEN   64      /* NAME_SPC_MAX_LEN of mdb.c */
+#define STUB_GROUP_ID_LEN       (2 * MQ_MAX_QNAME_LEN + 2)  /* as in mdb.c */
+
+int stub_msgs = 0;
+
+
+/**
+ * too_long()
+ *
+ * Whether the name space of the collection <name><suffix> is too long, as
+ * db_name_spc() of mdb.c would find it
+ *
+ *  name       - name of the queue or topic
+ *  suffix     - suffix of its collection
+ *
+ **/
+static bool
+too_long(const char *name, const char *suffix)
+{
+    return (STUB_NAME_SPC_MAX_LEN <= strlen(MONGO_DB_NAME ".") +
+            strlen(name) + strlen(suffix) + 1) ? true : false;
+}
+
+
+void
+mq_log(const char *log_level, const char *fname, const char *func,
+       int lineno, const char *fmt, ...)
+{
+}
+
+mq_err_t
+part_push(mongo *c, const char *qname, const char *key, const char *val,
+          unsigned int delay_ms, unsigned int max_deliveries, mq_trace_t *tr)
+{
+    if (too_long(qname, ".p0"))
+        return MQ_DB_QNAME_TOO_LONG;
+    stub_msgs++;
+    return MQ_OK;
+}
+
+mq_err_t
+part_pop(mongo *c, int worker_id, const char *qname, char *val,
+         mq_trace_t *tr)
+{
+    val[0] = '\0';
+    if (too_long(qname, ".p0"))
+        return MQ_DB_QNAME_TOO_LONG;
+    if (0 == stub_msgs)
+        return MQ_OK;
+
+    stub_msgs--;
+    snprintf(val, MQ_MAX_DATA_LEN, "%s", "fuzz");
+    return MQ_OK;
+}
+
+mq_err_t
+part_lease(mongo *c, int worker_id, const char *qname, unsigned int lease_ms,
+           char *val, char *id, int *deliveries, mq_trace_t *tr)
+{
+    val[0] = id[0] = '\0';
+    if (too_long(qname, ".p0"))
+        return MQ_DB_QNAME_TOO_LONG;
+    if (0 == stub_msgs)
+        return MQ_OK;
+
+    stub_msgs--;
+    snprintf(val, MQ_MAX_DATA_LEN, "%s", "fuzz");
+    snprintf(id, MQ_MSG_ID_LEN, "%s", "0-000000000000000000000000-1");
+    *deliveries = 1;
+    return MQ_OK;
+}
+
+mq_err_t
+part_ack(mongo *c, const char *qname, const char *id)
+{
+    if (too_long(qname, ".p0"))
+        return MQ_DB_QNAME_TOO_LONG;
+    return (0 == strcmp(id, "gone")) ? MQ_DB_MSG_NOT_LEASED : MQ_OK;
+}
+
+mq_err_t
+part_replay(mongo *c, const char *qname, int limit, int *replayed)
+{
+    *replayed = 0;
+    return too_long(qname, ".dead") ? MQ_DB_QNAME_TOO_LONG : MQ_OK;
+}
+
+mq_err_t
+part_dead_list(mongo *c, const char *qname, int limit, struct evbuffer *buf)
+{
+    if (too_long(qname, ".dead"))
+        return MQ_DB_QNAME_TOO_LONG;
+    evbuffer_add_printf(buf, "%s\n", "fuzz");
+    return MQ_OK;
+}
+
+mq_err_t
+db_topic_push(mongo *c, const char *topic, const char *val, int64_t *seq,
+              mq_trace_t *tr)
+{
+    if (too_long(topic, ".topic"))
+        return MQ_DB_QNAME_TOO_LONG;
+    *seq = ++stub_msgs;
+    return MQ_OK;
+}
+
+mq_err_t
+db_topic_pop(mongo *c, const char *topic, const char *group, char *val,
+             int64_t *seq, mq_trace_t *tr)
+{
+    val[0] = '\0';
+    if (too_long(topic, ".topic") ||
+            STUB_GROUP_ID_LEN <= strlen(topic) + strlen(".") + strlen(group))
+        return MQ_DB_QNAME_TOO_LONG;
+    if (0 == stub_msgs)
+        return MQ_OK;
+
+    *seq = stub_msgs--;
+    snprintf(val, MQ_MAX_DATA_LEN, "%s", "fuzz");
+    return MQ_OK;
+}
+
+mq_err_t
+dedup_begin(mongo *c, const char *qname, const char *key, mq_claim_t *claim,
+            int64_t *at, mq_trace_t *tr)
+{
+    if (MQ_DEDUP_ID_LEN <= strlen(qname) + strlen(".") + strlen(key))
+        return MQ_DB_QNAME_TOO_LONG;
+    *claim = (0 == strcmp(key, "dup")) ? MQ_CLAIM_DONE :
+             (0 == strcmp(key, "pending")) ? MQ_CLAIM_PENDING : MQ_CLAIM_NEW;
+    *at = 0;
+    return MQ_OK;
+}
+
+void
+dedup_end(mongo *c, const char *qname, const char *key, int64_t at,
+          bool pushed, mq_trace_t *tr)
+{
+}
+
+void
+dead_track(ev_thread_t *e, const char *qname)
+{
+}
+
+void
+topic_track(ev_thread_t *e, const char *topic)
+{
+}
@@ -0,0 +1,16 @@
+/*
+ *  stubs.h
+ *
+ *  In-memory stubs of the db side of the server, for the tests that run the
+ *  http side in-process, see test/stubs.c
+ *
+ *  Author: rp <rp@meetrp.com>
+ *
+ */
+
+#ifndef _STUBS_H_
+#define _STUBS_H_
+
+extern int stub_msgs;           /* messages "in" the stubbed queues */
+
+#endif /* _STUBS_H_ */
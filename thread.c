@@ -11,9 +11,11 @@
 #include <pthread.h>
 #include <sys/socket.h>
 #include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 /* our includes */
 #include "common.h"
@@ -27,11 +29,6 @@
 //static pthread_mutex_t init_lock;
 //static pthread_cont_t init_cond;
 
-typedef struct _ev_thread_t {
-    pthread_t evt_pthread;
-    struct evhttp *evt_httpd;
-} ev_thread_t;
-
 
 static mq_err_t
 setnonblock(int fd)
@@ -63,6 +60,10 @@ create_and_bind_socket(int port, int* fd)
 {
     mq_err_t ret_code = MQ_ERR;
     struct sockaddr_in server_addr;
+    int on = 1;
+#ifdef TCP_DEFER_ACCEPT
+    int defer_secs = MQ_TCP_DEFER_ACCEPT_SECS;
+#endif
 
     /* create a internet stream socket */
     int listenfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -72,6 +73,22 @@ create_and_bind_socket(int port, int* fd)
         goto end;
     }
 
+    /* these are only optimizations, so failing to set them is not fatal:
+     *  SO_REUSEADDR     - restart without waiting for TIME_WAIT to clear
+     *  TCP_NODELAY      - inherited by the accepted sockets, so that small
+     *                     replies are not held back by Nagle
+     *  TCP_DEFER_ACCEPT - (linux) wake up only once the request has arrived
+     */
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
+        mqwarn("unable to set SO_REUSEADDR");
+    if (setsockopt(listenfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+        mqwarn("unable to set TCP_NODELAY");
+#ifdef TCP_DEFER_ACCEPT
+    if (setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_secs,
+                   sizeof(defer_secs)) < 0)
+        mqwarn("unable to set TCP_DEFER_ACCEPT");
+#endif
+
     /* Initialize the socket address with the port */
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
@@ -125,24 +142,193 @@ ev_dispatcher(void *arg)
 }
 
 
-mq_err_t
-thread_init(int nthreads, ev_hdlr handler_fn, struct event_base *ev_base)
+/* workers that are being dispatched & the socket they accept on */
+static ev_thread_t *workers = NULL;
+static int nworkers = 0;
+static int listen_fd = -1;
+
+
+/**
+ * worker_init()
+ *
+ * Set up a worker with its own event base, db connection, timer wheel,
+ * long poll waiters, dead letter sweeper, topic compactor & httpd server
+ * accepting on the shared socket. The event base is not shared, as a
+ * libevent base must be dispatched by only one thread.
+ *
+ * The httpd server is given a dup of the socket, as evhttp_free() closes
+ * the socket it accepts on; the original is owned by thread_init().
+ *
+ *  evt        - worker to be set up
+ *  id         - worker #
+ *  handler_fn - http event handler
+ *  sock_fd    - listening socket shared by all the workers
+ *
+ **/
+static mq_err_t
+worker_init(ev_thread_t *evt, int id, ev_hdlr handler_fn, int sock_fd)
 {
     mq_err_t ret_code = MQ_ERR;
-    int sock_fd = -1;
-    int i = 0, j = 0, created = 0;
-    ev_thread_t evt[nthreads];
+    int fd = -1;
+
+    memset(evt, 0, sizeof(ev_thread_t));
+    evt->evt_id = id;
 
-    if (NULL == ev_base) {
-        mqerr("a NULL event");
-        ret_code = MQ_EV_INIT_FAILED;       /* re-using the libevent err */
+    evt->evt_base = event_base_new();
+    if (NULL == evt->evt_base) {
+        mqerr("unable to create event base #%d", id);
+        ret_code = MQ_EV_INIT_FAILED;
         goto end;
     }
 
+    /* each worker gets its own db connection */
+    ret_code = db_init(&(evt->evt_conn));
+    if (MQ_OK != ret_code) {
+        mqerr("DB init has failed for #%d: %s", id, MQ_ERR_STR(ret_code));
+        goto db_init_failed;
+    }
+    mqdbg("worker #%d connected to db", id);
+
+    /* the TTL index of the idempotency keys; without it they do not
+     * expire in mongo db, but pushes are still deduplicated */
+    if (0 == id && MQ_OK != db_dedup_init(evt->evt_conn))
+        mqwarn("idempotency keys will not expire in mongo db");
+
+    /* timer wheel for the delayed messages & long poll waiters */
+    evt->evt_wheel = tw_new(evt->evt_base);
+    if (NULL == evt->evt_wheel) {
+        mqerr("unable to create timer wheel #%d", id);
+        ret_code = MQ_MALLOC_FAILED;
+        goto timer_wheel_failed;
+    }
+
+    /* long poll waiters, woken by this or the other workers */
+    ret_code = waiter_init(evt, evt->evt_base);
+    if (MQ_OK != ret_code) {
+        mqerr("unable to set up long polling #%d", id);
+        goto waiter_init_failed;
+    }
+
+    /* sweeper of the dead letters of the queues leased by the worker */
+    ret_code = dead_init(evt, evt->evt_base);
+    if (MQ_OK != ret_code) {
+        mqerr("unable to create dead letter sweeper #%d", id);
+        goto dead_init_failed;
+    }
+
+    /* compactor of the topics served by the worker */
+    ret_code = topic_init(evt, evt->evt_base);
+    if (MQ_OK != ret_code) {
+        mqerr("unable to create topic compactor #%d", id);
+        goto topic_init_failed;
+    }
+
+    /* create a new http event */
+    evt->evt_httpd = evhttp_new(evt->evt_base);
+    if (NULL == evt->evt_httpd) {
+        mqerr("unable to create httpd server #%d", id);
+        ret_code = MQ_EV_CREATE_HTTP_SERVER_FAILED;
+        goto create_http_server_failed;
+    }
+    mqdbg("new httpd event created: %p", evt->evt_httpd);
+
+    /* bind the worker's own dup of the socket with httpd server */
+    fd = dup(sock_fd);
+    if (fd < 0) {
+        mqerr("unable to dup the socket for #%d", id);
+        ret_code = MQ_EV_HTTP_SOCKET_BIND_FAILED;
+        goto bind_http_with_socket_failed;
+    }
+    if (evhttp_accept_socket(evt->evt_httpd, fd) != 0) {
+        mqerr("unable to bind the socket with httpd server");
+        close(fd);
+        ret_code = MQ_EV_HTTP_SOCKET_BIND_FAILED;
+        goto bind_http_with_socket_failed;
+    }
+    mqdbg("bound the socket with the httpd server");
+
+    /* keep-alive connections are closed once idle, & requests are bounded
+     * so that a client can not make the server buffer unbounded data */
+    evhttp_set_timeout(evt->evt_httpd, MQ_HTTP_TIMEOUT_SECS);
+    evhttp_set_max_headers_size(evt->evt_httpd, MQ_HTTP_MAX_HEADERS_LEN);
+    evhttp_set_max_body_size(evt->evt_httpd, MQ_HTTP_MAX_BODY_LEN);
+    evhttp_set_allowed_methods(evt->evt_httpd,
+            EVHTTP_REQ_GET | EVHTTP_REQ_POST | EVHTTP_REQ_DELETE);
+
+    /* set a callback for the httpd server */
+    evhttp_set_gencb(evt->evt_httpd, handler_fn, (void *)evt);
+
+    ret_code = MQ_OK;
+end:
+    return ret_code;
+
+bind_http_with_socket_failed:
+    evhttp_free(evt->evt_httpd);
+create_http_server_failed:
+    topic_free(evt);
+topic_init_failed:
+    dead_free(evt);
+dead_init_failed:
+    waiter_free(evt);
+waiter_init_failed:
+    tw_free(evt->evt_wheel);
+timer_wheel_failed:
+    db_deinit(evt->evt_conn);
+db_init_failed:
+    event_base_free(evt->evt_base);
+    goto end;
+}
+
+
+/**
+ * worker_deinit()
+ *
+ * Tear down a worker set up by worker_init(); its thread must have exited
+ *
+ *  evt        - worker
+ *
+ **/
+static void
+worker_deinit(ev_thread_t *evt)
+{
+    evhttp_free(evt->evt_httpd);
+    topic_free(evt);
+    dead_free(evt);
+    waiter_free(evt);
+    tw_free(evt->evt_wheel);
+    db_deinit(evt->evt_conn);
+    event_base_free(evt->evt_base);
+}
+
+
+/**
+ * thread_init()
+ *
+ * Create 'nthreads' workers, each dispatching its own event base. Returns
+ * once they are running; they are stopped by thread_stop() & waited for by
+ * thread_join().
+ *
+ *  nthreads   - # of workers
+ *  handler_fn - http event handler
+ *
+ **/
+mq_err_t
+thread_init(int nthreads, ev_hdlr handler_fn)
+{
+    mq_err_t ret_code = MQ_ERR;
+    int i = 0, created = 0;
+
     mqdbg("nthreads: %d", nthreads);
 
+    workers = (ev_thread_t *)malloc(nthreads * sizeof(ev_thread_t));
+    if (NULL == workers) {
+        mqerr("malloc failed for %zu bytes", nthreads * sizeof(ev_thread_t));
+        ret_code = MQ_MALLOC_FAILED;
+        goto end;
+    }
+
     /* create & bind a scoket to a given port */
-    ret_code = create_and_bind_socket(MQ_SERVER_PORT, &sock_fd);
+    ret_code = create_and_bind_socket(MQ_SERVER_PORT, &listen_fd);
     if (MQ_OK != ret_code) {
         mqerr("bind_socked functin failed!");
         goto socket_bind_failed;
@@ -150,58 +336,106 @@ thread_init(int nthreads, ev_hdlr handler_fn, struct event_base *ev_base)
     mqdbg("created a socket @ %d - %d", MQ_SERVER_PORT, ret_code);
 
     for (; i < nthreads; i++) {
-        /* create a new http event */
-        evt[i].evt_httpd = evhttp_new(ev_base);
-        if (NULL == evt[i].evt_httpd) {
-            mqerr("unable to create httpd server #%d", i);
-            if (i)
-                mqerr("cleanup begins");
-            ret_code = MQ_EV_CREATE_HTTP_SERVER_FAILED;
-            goto create_http_server_failed;
+        ret_code = worker_init(&workers[created], created, handler_fn,
+                               listen_fd);
+        if (MQ_OK != ret_code) {
+            mqerr("worker #%d init failed: %s", i, MQ_ERR_STR(ret_code));
+            continue;       // continue if a worker is unable to be set up.
         }
-        mqdbg("new httpd event created: %p", evt[i].evt_httpd);
-
-        /* bind the socket with httpd server */
-        if (evhttp_accept_socket(evt[i].evt_httpd, sock_fd) != 0) {
-            mqerr("unable to bind the socket with httpd server");
-            mqerr("cleanup begins");
-            ret_code = MQ_EV_HTTP_SOCKET_BIND_FAILED;
-            evhttp_free(evt[i].evt_httpd);
-            goto bind_http_with_socket_failed;
-        }
-        mqdbg("bound the socket with the httpd server");
-
-        /* set a callback for the httpd server */
-        evhttp_set_gencb(evt[i].evt_httpd, handler_fn, NULL);
 
-        if (0 != pthread_create(&(evt[i].evt_pthread), NULL, &ev_dispatcher,
-                                    (void *)ev_base)) {
+        if (0 != pthread_create(&(workers[created].evt_pthread), NULL,
+                                &ev_dispatcher,
+                                (void *)workers[created].evt_base)) {
             mqerr("unable to create thread #%d", i);
-            evhttp_free(evt[i].evt_httpd);
+            worker_deinit(&workers[created]);
             continue;       // continue if a thread is unable to be created.
         }
 
+        /* publish the worker to the running ones, see thread_workers() */
         created++;
+        __sync_fetch_and_add(&nworkers, 1);
     }
 
     if (created != nthreads)
         mqerr("Only %d threads created", created);
-    if (created == 0)
+    if (created == 0) {
         ret_code = MQ_THR_CREATE_FAILED;
-
-    mqdbg("waiting for #%d threads created to close", created);
-    for (i=0; i<created; i++) {
-        mqdbg("waiting to close #%d", i);
-        pthread_join(evt[i].evt_pthread, NULL);
+        goto thread_create_failed;
     }
 
-socket_bind_failed:
+    ret_code = MQ_OK;
 end:
     return ret_code;
 
-bind_http_with_socket_failed:
-create_http_server_failed:
-    for (; j < i; j++)
-        evhttp_free(evt[j].evt_httpd);
+thread_create_failed:
+    close(listen_fd);
+    listen_fd = -1;
+socket_bind_failed:
+    free(workers);
+    workers = NULL;
     goto end;
 }
+
+
+/**
+ * thread_stop()
+ *
+ * Make all the workers exit their event loops. Relies on
+ * evthread_use_pthreads() having been called.
+ *
+ **/
+void
+thread_stop(void)
+{
+    int i = 0;
+
+    for (; i < nworkers; i++)
+        event_base_loopexit(workers[i].evt_base, NULL);
+}
+
+
+/**
+ * thread_join()
+ *
+ * Wait for all the workers to exit & tear them down
+ *
+ **/
+void
+thread_join(void)
+{
+    int i = 0;
+
+    mqdbg("waiting for #%d threads created to close", nworkers);
+    for (; i < nworkers; i++) {
+        mqdbg("waiting to close #%d", i);
+        pthread_join(workers[i].evt_pthread, NULL);
+    }
+
+    /* only once none is running, as a worker may wake the others */
+    for (i = 0; i < nworkers; i++)
+        worker_deinit(&workers[i]);
+
+    nworkers = 0;
+    free(workers);
+    workers = NULL;
+    close(listen_fd);
+    listen_fd = -1;
+}
+
+
+/**
+ * thread_workers()
+ *
+ * The workers that are running, for a worker to reach the others. A
+ * worker is published only once it is fully set up; the array is not
+ * touched again till thread_join().
+ *
+ *  n          - # of workers is returned here
+ *
+ **/
+ev_thread_t*
+thread_workers(int *n)
+{
+    *n = __atomic_load_n(&nworkers, __ATOMIC_ACQUIRE);
+    return workers;
+}
@@ -0,0 +1,305 @@
+/*
+ *  timer.c
+ *
+ *  Hierarchical timer wheel. Each worker owns one, driven by a libevent
+ *  timer that ticks every MQ_TIMER_TICK_MS only while the wheel has any
+ *  pending timer. Adding, deleting & expiring a timer are all O(1), except
+ *  for the occasional cascade of a slot into the lower level.
+ *
+ *  Author: rp <rp@meetrp.com>
+ *
+ */
+
+/* system includes */
+#include <stdlib.h>             /* malloc, free */
+#include <string.h>             /* memset */
+#include <event.h>              /* evtimer_* */
+
+/* our includes */
+#include "common.h"
+#include "config.h"
+#include "mongoq.h"
+
+
+/* locally used */
+#define TW_LEVELS           4
+#define TW_SLOT_BITS        6
+#define TW_SLOTS            (1 << TW_SLOT_BITS)
+#define TW_SLOT_MASK        (TW_SLOTS - 1)
+#define TW_MAX_TICKS        ((uint64_t)1 << (TW_LEVELS * TW_SLOT_BITS))
+
+struct _tw_wheel_t {
+    uint64_t tw_now;                    /* current tick */
+    uint64_t tw_start_ms;               /* monotonic time of tick 0 */
+    int tw_count;                       /* # of pending timers */
+    bool tw_busy;                       /* expiring timers in tw_tick() */
+    struct event *tw_ev;                /* ticks while tw_count > 0 */
+    tw_timer_t *tw_slots[TW_LEVELS][TW_SLOTS];
+};
+
+
+/**
+ * tw_link()
+ *
+ * Place the timer into the slot matching its expiry. The level is picked
+ * by how far away the expiry is, the slot by the expiry bits of that level.
+ *
+ *  w          - timer wheel
+ *  t          - timer to be placed
+ *
+ **/
+static void
+tw_link(tw_wheel_t *w, tw_timer_t *t)
+{
+    uint64_t delta = t->tm_expires - w->tw_now;
+    uint64_t expires = t->tm_expires;
+    int level = 0;
+    tw_timer_t **slot = NULL;
+
+    /* farther than the wheel can hold; re-placed when cascaded */
+    if (delta >= TW_MAX_TICKS)
+        expires = w->tw_now + TW_MAX_TICKS - 1;
+
+    for (delta = expires - w->tw_now; level < TW_LEVELS - 1; level++)
+        if (delta < ((uint64_t)1 << ((level + 1) * TW_SLOT_BITS)))
+            break;
+
+    slot = &w->tw_slots[level][(expires >> (level * TW_SLOT_BITS)) &
+                               TW_SLOT_MASK];
+    t->tm_prev = NULL;
+    t->tm_next = *slot;
+    if (NULL != *slot)
+        (*slot)->tm_prev = t;
+    *slot = t;
+    t->tm_slot = slot;
+}
+
+
+/**
+ * tw_unlink()
+ *
+ * Take the timer out of its slot
+ *
+ *  t          - timer to be removed
+ *
+ **/
+static void
+tw_unlink(tw_timer_t *t)
+{
+    if (NULL != t->tm_prev)
+        t->tm_prev->tm_next = t->tm_next;
+    else
+        *(t->tm_slot) = t->tm_next;
+
+    if (NULL != t->tm_next)
+        t->tm_next->tm_prev = t->tm_prev;
+
+    t->tm_next = t->tm_prev = NULL;
+    t->tm_slot = NULL;
+}
+
+
+/**
+ * tw_cascade()
+ *
+ * Move all the timers of a slot in 'level' to the lower levels
+ *
+ *  w          - timer wheel
+ *  level      - level of the slot
+ *  idx        - index of the slot
+ *
+ **/
+static void
+tw_cascade(tw_wheel_t *w, int level, int idx)
+{
+    tw_timer_t *t = w->tw_slots[level][idx];
+    tw_timer_t *next = NULL;
+
+    w->tw_slots[level][idx] = NULL;
+    for (; NULL != t; t = next) {
+        next = t->tm_next;
+        tw_link(w, t);
+    }
+}
+
+
+/**
+ * tw_advance()
+ *
+ * Advance the wheel by one tick & expire the timers of that tick
+ *
+ *  w          - timer wheel
+ *
+ **/
+static void
+tw_advance(tw_wheel_t *w)
+{
+    tw_timer_t *t = NULL;
+    int level = 1, idx = 0;
+
+    w->tw_now++;
+
+    /* cascade the higher levels whenever the lower one wraps around */
+    for (; level < TW_LEVELS; level++) {
+        if (0 != ((w->tw_now >> ((level - 1) * TW_SLOT_BITS)) & TW_SLOT_MASK))
+            break;
+        tw_cascade(w, level,
+                   (w->tw_now >> (level * TW_SLOT_BITS)) & TW_SLOT_MASK);
+    }
+
+    /* callbacks may add or delete timers, so always take the head */
+    idx = w->tw_now & TW_SLOT_MASK;
+    while (NULL != (t = w->tw_slots[0][idx])) {
+        tw_unlink(t);
+        w->tw_count--;
+        t->tm_cb(t->tm_arg);
+    }
+}
+
+
+/**
+ * tw_tick()
+ *
+ * libevent timer callback; catches the wheel up with the clock
+ *
+ *  fd         - unused
+ *  what       - unused
+ *  arg        - timer wheel
+ *
+ **/
+static void
+tw_tick(evutil_socket_t fd, short what, void *arg)
+{
+    tw_wheel_t *w = (tw_wheel_t *) arg;
+    uint64_t target = (mono_ms() - w->tw_start_ms) / MQ_TIMER_TICK_MS;
+
+    w->tw_busy = true;
+    while (w->tw_now < target && w->tw_count > 0)
+        tw_advance(w);
+    w->tw_busy = false;
+
+    /* nothing pending, keep the tick count in sync & stop ticking */
+    if (0 == w->tw_count) {
+        w->tw_now = target;
+        evtimer_del(w->tw_ev);
+    }
+}
+
+
+/**
+ * tw_new()
+ *
+ * Create a timer wheel on the given event base
+ *
+ *  ev_base    - event base of the worker that owns the wheel
+ *
+ **/
+tw_wheel_t*
+tw_new(struct event_base *ev_base)
+{
+    tw_wheel_t *w = (tw_wheel_t *)malloc(sizeof(tw_wheel_t));
+    if (NULL == w) {
+        mqerr("malloc failed for %zu bytes", sizeof(tw_wheel_t));
+        return NULL;
+    }
+
+    memset(w, 0, sizeof(tw_wheel_t));
+    w->tw_start_ms = mono_ms();
+    w->tw_ev = event_new(ev_base, -1, EV_PERSIST, tw_tick, w);
+    if (NULL == w->tw_ev) {
+        mqerr("unable to create the timer wheel event");
+        free(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+
+/**
+ * tw_free()
+ *
+ * Free the timer wheel. Pending timers are dropped without being expired;
+ * whatever they are embedded in is freed by their owners.
+ *
+ *  w          - timer wheel
+ *
+ **/
+void
+tw_free(tw_wheel_t *w)
+{
+    event_free(w->tw_ev);
+    free(w);
+}
+
+
+/**
+ * tw_ticks()
+ *
+ * The tick at which a timer added now to expire after 'ms' milli seconds
+ * would expire; timers expiring in the same tick are expired together
+ *
+ *  w          - timer wheel
+ *  ms         - milli seconds from now
+ *
+ **/
+uint64_t
+tw_ticks(tw_wheel_t *w, unsigned int ms)
+{
+    uint64_t now = (mono_ms() - w->tw_start_ms) / MQ_TIMER_TICK_MS;
+
+    return now + ((uint64_t) ms + MQ_TIMER_TICK_MS - 1) / MQ_TIMER_TICK_MS + 1;
+}
+
+
+/**
+ * tw_add()
+ *
+ * Arm the timer to expire after 'ms' milli seconds. The expiry is rounded
+ * up to the next tick, so a timer never expires early.
+ *
+ *  w          - timer wheel
+ *  t          - timer; must not be pending
+ *  ms         - expire after these many milli seconds
+ *  cb         - called on expiry, with 'arg'
+ *  arg        - arg to 'cb'
+ *
+ **/
+void
+tw_add(tw_wheel_t *w, tw_timer_t *t, unsigned int ms, tw_cb cb, void *arg)
+{
+    struct timeval tick = {0, MQ_TIMER_TICK_MS * 1000};
+
+    /* an idle wheel does not tick; catch up before linking */
+    if (0 == w->tw_count && !w->tw_busy)
+        w->tw_now = (mono_ms() - w->tw_start_ms) / MQ_TIMER_TICK_MS;
+
+    t->tm_cb = cb;
+    t->tm_arg = arg;
+    t->tm_expires = tw_ticks(w, ms);
+    tw_link(w, t);
+
+    if (0 == w->tw_count++)
+        evtimer_add(w->tw_ev, &tick);
+}
+
+
+/**
+ * tw_del()
+ *
+ * Disarm the timer, if it is pending
+ *
+ *  w          - timer wheel
+ *  t          - timer
+ *
+ **/
+void
+tw_del(tw_wheel_t *w, tw_timer_t *t)
+{
+    if (NULL == t->tm_slot)
+        return;
+
+    tw_unlink(t);
+    if (0 == --w->tw_count)
+        evtimer_del(w->tw_ev);
+}
@@ -0,0 +1,65 @@
+/*
+ *  topic.c
+ *
+ *  Topics. A message pushed into a topic is stored once & is popped by
+ *  each consumer group, which has its own offset. Each worker remembers
+ *  the topics it has served & periodically compacts them, i.e., removes
+ *  the messages that all the groups have consumed.
+ *
+ *  Author: rp <rp@meetrp.com>
+ *
+ */
+
+/* our includes */
+#include "common.h"
+#include "config.h"
+#include "mongoq.h"
+
+
+/**
+ * topic_init()
+ *
+ * Set up the topic compactor of the worker
+ *
+ *  evt        - worker
+ *  ev_base    - event base of the worker
+ *
+ **/
+mq_err_t
+topic_init(ev_thread_t *evt, struct event_base *ev_base)
+{
+    return track_init(&evt->evt_topics, evt, ev_base, MQ_TOPIC_COMPACT_MS,
+                      MQ_TOPIC_MAX_TOPICS, db_topic_compact, "compaction");
+}
+
+
+/**
+ * topic_free()
+ *
+ * Tear down the topic compactor of the worker
+ *
+ *  evt        - worker
+ *
+ **/
+void
+topic_free(ev_thread_t *evt)
+{
+    track_free(evt->evt_topics);
+    evt->evt_topics = NULL;
+}
+
+
+/**
+ * topic_track()
+ *
+ * Remember 'topic' to be compacted, as it has been served by the worker
+ *
+ *  evt        - worker
+ *  topic      - name of the topic
+ *
+ **/
+void
+topic_track(ev_thread_t *evt, const char *topic)
+{
+    track_add(evt->evt_topics, topic);
+}
@@ -0,0 +1,176 @@
+/*
+ *  trace.c
+ *
+ *  Lightweight per request tracing. Each request gets an id & monotonic
+ *  timestamps of its stages; the ones slower than MQ_SLOW_LOG_THRESHOLD_MS
+ *  are kept in an in-memory ring, the slow log.
+ *
+ *  Author: rp <rp@meetrp.com>
+ *
+ */
+
+/* system includes */
+#include <string.h>             /* memset */
+#include <pthread.h>            /* pthread_mutex_* */
+
+/* our includes */
+#include "common.h"
+#include "config.h"
+#include "mongoq.h"
+
+
+/* locally used */
+#define SLOW_QNAME_MAX_LEN  64
+
+typedef struct _slow_entry_t {
+    mq_trace_t se_trace;
+    char se_qname[SLOW_QNAME_MAX_LEN];  /* copy, tr_qname does not live on */
+} slow_entry_t;
+
+static unsigned long next_req_id = 0;
+
+/* the slow log ring, shared by all the workers */
+static slow_entry_t slow_log[MQ_SLOW_LOG_SIZE];
+static unsigned long slow_log_next = 0;
+static pthread_mutex_t slow_log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * stage_delta()
+ *
+ * Time spent between two stages, or 0 if either of them was never reached
+ *
+ *  tr         - trace of the request
+ *  from       - earlier stage
+ *  to         - later stage
+ *
+ **/
+static uint64_t
+stage_delta(const mq_trace_t *tr, mq_stage_t from, mq_stage_t to)
+{
+    if (0 == tr->tr_ts[from] || 0 == tr->tr_ts[to])
+        return 0;
+
+    return tr->tr_ts[to] - tr->tr_ts[from];
+}
+
+
+/**
+ * trace_begin()
+ *
+ * Assign a new request id & mark the request as accepted
+ *
+ *  tr         - trace of the request
+ *
+ **/
+void
+trace_begin(mq_trace_t *tr)
+{
+    memset(tr, 0, sizeof(*tr));
+    tr->tr_id = __sync_add_and_fetch(&next_req_id, 1);
+    tr->tr_ts[MQ_STAGE_ACCEPT] = now_usecs();
+}
+
+
+/**
+ * trace_mark()
+ *
+ * Timestamp the given stage. A request can go to the db more than once
+ * (e.g. a pop stealing from other partitions), so MQ_STAGE_DB_SEND keeps
+ * the first send while every other stage keeps the latest one.
+ *
+ *  tr         - trace of the request (can be NULL)
+ *  stage      - stage that has just been reached
+ *
+ **/
+void
+trace_mark(mq_trace_t *tr, mq_stage_t stage)
+{
+    if (NULL == tr)
+        return;
+
+    if (MQ_STAGE_DB_SEND == stage) {
+        tr->tr_db_calls++;
+        if (0 != tr->tr_ts[stage])
+            return;
+    }
+
+    tr->tr_ts[stage] = now_usecs();
+}
+
+
+/**
+ * trace_end()
+ *
+ * Mark the response as flushed & add the request to the slow log if it
+ * took longer than MQ_SLOW_LOG_THRESHOLD_MS
+ *
+ *  tr         - trace of the request
+ *
+ **/
+void
+trace_end(mq_trace_t *tr)
+{
+    slow_entry_t *se = NULL;
+
+    trace_mark(tr, MQ_STAGE_FLUSH);
+    if (stage_delta(tr, MQ_STAGE_ACCEPT, MQ_STAGE_FLUSH) <
+            (uint64_t)MQ_SLOW_LOG_THRESHOLD_MS * 1000)
+        return;
+
+    pthread_mutex_lock(&slow_log_lock);
+    se = &slow_log[slow_log_next++ % MQ_SLOW_LOG_SIZE];
+    se->se_trace = *tr;
+    snprintf(se->se_qname, sizeof(se->se_qname), "%s",
+             (NULL != tr->tr_qname) ? tr->tr_qname : "-");
+    se->se_trace.tr_qname = se->se_qname;
+    pthread_mutex_unlock(&slow_log_lock);
+}
+
+
+/**
+ * trace_dump()
+ *
+ * Dump the slow log, oldest first, into 'buf'. All the times are in usecs:
+ *   parse   - accept to routed
+ *   wait    - routed to the first db send
+ *   db      - first db send to the last db reply
+ *   reply   - last db reply (or routed) to the response flush
+ *
+ *  buf        - event buffer into which the slow log is written
+ *
+ **/
+void
+trace_dump(struct evbuffer *buf)
+{
+    unsigned long i = 0;
+    const mq_trace_t *tr = NULL;
+    mq_stage_t last = MQ_STAGE_PARSE;
+
+    pthread_mutex_lock(&slow_log_lock);
+    if (slow_log_next > MQ_SLOW_LOG_SIZE)
+        i = slow_log_next - MQ_SLOW_LOG_SIZE;
+
+    for (; i < slow_log_next; i++) {
+        tr = &slow_log[i % MQ_SLOW_LOG_SIZE].se_trace;
+        last = (0 != tr->tr_ts[MQ_STAGE_DB_REPLY]) ?
+                    MQ_STAGE_DB_REPLY : MQ_STAGE_PARSE;
+
+        evbuffer_add_printf(buf,
+                "id=%lu q=%s total=%llu parse=%llu wait=%llu "
+                "db=%llu(%d) reply=%llu\n",
+                tr->tr_id, tr->tr_qname,
+                (unsigned long long)
+                    stage_delta(tr, MQ_STAGE_ACCEPT, MQ_STAGE_FLUSH),
+                (unsigned long long)
+                    stage_delta(tr, MQ_STAGE_ACCEPT, MQ_STAGE_PARSE),
+                (unsigned long long)
+                    stage_delta(tr, MQ_STAGE_PARSE, MQ_STAGE_DB_SEND),
+                (unsigned long long)
+                    stage_delta(tr, MQ_STAGE_DB_SEND, MQ_STAGE_DB_REPLY),
+                tr->tr_db_calls,
+                (unsigned long long)
+                    stage_delta(tr, last, MQ_STAGE_FLUSH));
+    }
+    pthread_mutex_unlock(&slow_log_lock);
+}
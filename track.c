@@ -0,0 +1,151 @@
+/*
+ *  track.c
+ *
+ *  Names tracked by a worker for periodic upkeep. A worker remembers, up
+ *  to a limit, the queues or topics it has served & a timer of its event
+ *  base calls back on each of them with the worker's db connection. The
+ *  dead letter sweeper & the topic compactor are built on it.
+ *
+ *  Author: rp <rp@meetrp.com>
+ *
+ */
+
+/* system includes */
+#include <stdlib.h>             /* malloc, free */
+#include <string.h>             /* strcmp, strcpy, strlen */
+#include <event.h>              /* event_* */
+
+/* our includes */
+#include "common.h"
+#include "config.h"
+#include "mongoq.h"
+
+
+/* locally used */
+#define TRACK_NAME_MAX_LEN  64
+
+struct _mq_track_t {
+    struct event *tk_ev;                /* runs tk_cb every period */
+    ev_thread_t *tk_evt;                /* worker, for its db connection */
+    track_cb tk_cb;
+    const char *tk_what;                /* what tk_cb does, for the logs */
+    int tk_max;
+    int tk_nnames;
+    char tk_names[][TRACK_NAME_MAX_LEN];
+};
+
+
+/**
+ * track_run()
+ *
+ * libevent timer callback; call back on all the tracked names
+ *
+ *  fd         - unused
+ *  what       - unused
+ *  arg        - tracker
+ *
+ **/
+static void
+track_run(evutil_socket_t fd, short what, void *arg)
+{
+    mq_track_t *tk = (mq_track_t *) arg;
+    mq_err_t ret_code = MQ_ERR;
+    int i = 0;
+
+    for (; i < tk->tk_nnames; i++) {
+        ret_code = tk->tk_cb(tk->tk_evt->evt_conn, tk->tk_names[i]);
+        if (MQ_OK != ret_code)
+            mqerr("%s of %s failed: %s", tk->tk_what, tk->tk_names[i],
+                    MQ_ERR_STR(ret_code));
+    }
+}
+
+
+/**
+ * track_init()
+ *
+ * Set up a tracker of the worker, which calls back every 'period_ms' on
+ * each of up to 'max' names
+ *
+ *  tk_out     - tracker is returned here
+ *  evt        - worker
+ *  ev_base    - event base of the worker
+ *  period_ms  - period of the call backs, in milli secs
+ *  max        - max # of names tracked
+ *  cb         - called back with the worker's db connection & a name
+ *  what       - what 'cb' does, e.g., "sweep"; for the logs
+ *
+ **/
+mq_err_t
+track_init(mq_track_t **tk_out, ev_thread_t *evt, struct event_base *ev_base,
+           unsigned int period_ms, int max, track_cb cb, const char *what)
+{
+    struct timeval tv = {period_ms / 1000, (period_ms % 1000) * 1000};
+    size_t size = sizeof(mq_track_t) + (size_t) max * TRACK_NAME_MAX_LEN;
+    mq_track_t *tk = (mq_track_t *)malloc(size);
+    if (NULL == tk) {
+        mqerr("malloc failed for %zu bytes", size);
+        return MQ_MALLOC_FAILED;
+    }
+
+    tk->tk_evt = evt;
+    tk->tk_cb = cb;
+    tk->tk_what = what;
+    tk->tk_max = max;
+    tk->tk_nnames = 0;
+    tk->tk_ev = event_new(ev_base, -1, EV_PERSIST, track_run, tk);
+    if (NULL == tk->tk_ev || 0 != evtimer_add(tk->tk_ev, &tv)) {
+        mqerr("unable to create the %s event", what);
+        if (NULL != tk->tk_ev)
+            event_free(tk->tk_ev);
+        free(tk);
+        return MQ_EV_INIT_FAILED;
+    }
+
+    *tk_out = tk;
+    return MQ_OK;
+}
+
+
+/**
+ * track_free()
+ *
+ * Tear down the tracker
+ *
+ *  tk         - tracker
+ *
+ **/
+void
+track_free(mq_track_t *tk)
+{
+    event_free(tk->tk_ev);
+    free(tk);
+}
+
+
+/**
+ * track_add()
+ *
+ * Track 'name', unless it is already or there is no room for it
+ *
+ *  tk         - tracker
+ *  name       - name of the queue or topic
+ *
+ **/
+void
+track_add(mq_track_t *tk, const char *name)
+{
+    int i = 0;
+
+    for (; i < tk->tk_nnames; i++)
+        if (0 == strcmp(tk->tk_names[i], name))
+            return;
+
+    if (tk->tk_max == tk->tk_nnames || TRACK_NAME_MAX_LEN <= strlen(name)) {
+        mqdbg("no %s of %s", tk->tk_what, name);
+        return;
+    }
+
+    strcpy(tk->tk_names[tk->tk_nnames++], name);
+    mqdbg("%s of %s", tk->tk_what, name);
+}
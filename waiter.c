@@ -0,0 +1,589 @@
+/*
+ *  waiter.c
+ *
+ *  Long poll waiters. A pop that finds its queue empty can wait for upto
+ *  MQ_MAX_WAIT_MS; it is parked on its worker & is woken when a message is
+ *  pushed into that queue by any worker, or when a delayed message of that
+ *  queue becomes visible.
+ *
+ *  A worker wakes its own waiters directly. The other workers, the ones
+ *  with waiters at all, are handed the queue name through their inbox &
+ *  an event activated on their event base. A delayed message is tracked by
+ *  the timer wheel of the worker it was pushed through, one timer per
+ *  queue & tick, which wakes the waiters of all the workers on expiry.
+ *
+ *  evhttp does not read from a connection while its reply is pending, so a
+ *  client that goes away while parked is not seen by it. The socket of each
+ *  waiter is watched, without reading from it, for the end of the stream;
+ *  its message would be popped only to be lost otherwise.
+ *
+ *  Author: rp <rp@meetrp.com>
+ *
+ */
+
+/* system includes */
+#include <stdlib.h>             /* malloc, free */
+#include <string.h>             /* strcmp */
+#include <errno.h>              /* errno */
+#include <sys/socket.h>         /* recv */
+#include <pthread.h>            /* pthread_mutex_* */
+#include <event.h>              /* event_* */
+
+/* our includes */
+#include "common.h"
+#include "config.h"
+#include "mongoq.h"
+
+
+/* locally used */
+#define WAITER_QNAME_MAX_LEN    64
+#define WAITER_INBOX_LEN        32      /* queues to wake, from others */
+#define DUE_BUCKETS             256     /* a power of 2 */
+
+typedef struct _mq_waiter_t {
+    struct _mq_waiter_t *wt_next;
+    struct _mq_waiter_t *wt_prev;
+    ev_thread_t *wt_evt;                /* worker it is parked on */
+    struct evhttp_request *wt_req;      /* the pop waiting for a reply */
+    struct event *wt_watch;             /* for the client to go away */
+    tw_timer_t wt_timer;                /* wait timeout */
+    bool wt_tried;                      /* woken while handling overflow */
+    char wt_qname[WAITER_QNAME_MAX_LEN];
+} mq_waiter_t;
+
+/* delayed messages of a queue that become visible in the same tick */
+typedef struct _due_t {
+    struct _due_t *du_next;             /* next in the hash bucket */
+    tw_timer_t du_timer;
+    ev_thread_t *du_evt;
+    uint64_t du_tick;
+    char du_qname[WAITER_QNAME_MAX_LEN];
+} due_t;
+
+struct _mq_wait_t {
+    mq_waiter_t *wa_waiters;            /* oldest first */
+    int wa_nwaiters;                    /* read by the other workers */
+    due_t *wa_dues[DUE_BUCKETS];
+
+    /* queues to wake, handed over by the other workers */
+    pthread_mutex_t wa_lock;
+    struct event *wa_ev;                /* activated by the other workers */
+    int wa_ninbox;
+    bool wa_overflow;                   /* inbox was full; wake them all */
+    char wa_inbox[WAITER_INBOX_LEN][WAITER_QNAME_MAX_LEN];
+};
+
+
+/**
+ * due_bucket()
+ *
+ * Hash bucket of the delayed messages of 'qname' due at 'tick'
+ *
+ *  wa         - long poll state of the worker
+ *  qname      - name of the queue
+ *  tick       - tick of the timer wheel
+ *
+ **/
+static due_t**
+due_bucket(mq_wait_t *wa, const char *qname, uint64_t tick)
+{
+    unsigned int hash = djb2_hash(qname);
+
+    return &wa->wa_dues[(hash ^ (unsigned int) tick) & (DUE_BUCKETS - 1)];
+}
+
+
+/**
+ * waiter_done()
+ *
+ * Unpark the waiter & free it. The reply, if any, is sent by the caller.
+ *
+ *  w          - waiter
+ *
+ **/
+static void
+waiter_done(mq_waiter_t *w)
+{
+    ev_thread_t *evt = w->wt_evt;
+    mq_wait_t *wa = evt->evt_wait;
+    struct evhttp_connection *evcon = evhttp_request_get_connection(w->wt_req);
+
+    if (NULL != w->wt_prev)
+        w->wt_prev->wt_next = w->wt_next;
+    else
+        wa->wa_waiters = w->wt_next;
+    if (NULL != w->wt_next)
+        w->wt_next->wt_prev = w->wt_prev;
+    __sync_fetch_and_sub(&wa->wa_nwaiters, 1);
+
+    tw_del(evt->evt_wheel, &w->wt_timer);
+    if (NULL != w->wt_watch)
+        event_free(w->wt_watch);
+    if (NULL != evcon)
+        evhttp_connection_set_closecb(evcon, NULL, NULL);
+    free(w);
+}
+
+
+/**
+ * waiter_timeout()
+ *
+ * Timer wheel callback; nothing showed up in the queue within the wait
+ *
+ *  arg        - waiter
+ *
+ **/
+static void
+waiter_timeout(void *arg)
+{
+    mq_waiter_t *w = (mq_waiter_t *) arg;
+
+    mqdbg("wait on %s timed out", w->wt_qname);
+    send_reply(w->wt_req, HTTP_NOCONTENT, "No Content", NULL);
+    waiter_done(w);
+}
+
+
+/**
+ * waiter_closed()
+ *
+ * The connection of the waiter is going down; there is nobody to reply to.
+ * A request that evhttp has already let go of is ours to free.
+ *
+ *  evcon      - http connection being closed
+ *  arg        - waiter
+ *
+ **/
+static void
+waiter_closed(struct evhttp_connection *evcon, void *arg)
+{
+    mq_waiter_t *w = (mq_waiter_t *) arg;
+    struct evhttp_request *req = w->wt_req;
+
+    mqdbg("waiter on %s closed the connection", w->wt_qname);
+    waiter_done(w);
+    if (NULL == evhttp_request_get_connection(req))
+        evhttp_request_free(req);
+}
+
+
+/**
+ * waiter_watch()
+ *
+ * libevent callback; the socket of the waiter is readable. The data is
+ * peeked at & left to evhttp. At the end of the stream, or on an error, the
+ * client is gone & the connection is freed, which unparks the waiter
+ * through waiter_closed(). A pipelined request is read by evhttp after the
+ * reply; the socket is not watched any more, as the end of the stream can
+ * no longer be told from it.
+ *
+ *  fd         - socket of the waiter's connection
+ *  what       - unused
+ *  arg        - waiter
+ *
+ **/
+static void
+waiter_watch(evutil_socket_t fd, short what, void *arg)
+{
+    mq_waiter_t *w = (mq_waiter_t *) arg;
+    char c = 0;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK);
+
+    if (0 < n)
+        return;
+    if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno)) {
+        event_add(w->wt_watch, NULL);
+        return;
+    }
+
+    mqdbg("waiter on %s went away", w->wt_qname);
+    evhttp_connection_free(evhttp_request_get_connection(w->wt_req));
+}
+
+
+/**
+ * waiter_wake()
+ *
+ * Retry the pops of the waiters on 'qname', oldest first, for as long as
+ * there are messages. A wakeup may stand for several messages, as they are
+ * merged in the inbox & in the due timers. If some other consumer got to
+ * the messages first, the rest of the waiters keep waiting.
+ *
+ *  evt        - worker
+ *  qname      - name of the queue
+ *
+ **/
+static void
+waiter_wake(ev_thread_t *evt, const char *qname)
+{
+    mq_err_t ret_code = MQ_ERR;
+    char val[MQ_MAX_DATA_LEN];
+    mq_waiter_t *w = NULL;
+
+    for (;;) {
+        for (w = evt->evt_wait->wa_waiters; NULL != w; w = w->wt_next)
+            if (0 == strcmp(w->wt_qname, qname))
+                break;
+        if (NULL == w)
+            return;
+
+        ret_code = part_pop(evt->evt_conn, evt->evt_id, qname, val, NULL);
+        if (MQ_OK != ret_code) {
+            /* the rest are left to their timeout, not failed as well */
+            mqerr("pop from %s failed: %s", qname, MQ_ERR_STR(ret_code));
+            send_reply(w->wt_req, HTTP_INTERNAL, "Internal Server Error",
+                       MQ_ERR_STR(ret_code));
+            waiter_done(w);
+            return;
+        }
+        if ('\0' == val[0])
+            return;
+
+        send_reply(w->wt_req, HTTP_OK, "OK", val);
+        waiter_done(w);
+    }
+}
+
+
+/**
+ * waiter_inbox()
+ *
+ * libevent callback, activated by the other workers; wake the waiters on
+ * the queues handed over in the inbox
+ *
+ *  fd         - unused
+ *  what       - unused
+ *  arg        - worker
+ *
+ **/
+static void
+waiter_inbox(evutil_socket_t fd, short what, void *arg)
+{
+    ev_thread_t *evt = (ev_thread_t *) arg;
+    mq_wait_t *wa = evt->evt_wait;
+    char inbox[WAITER_INBOX_LEN][WAITER_QNAME_MAX_LEN];
+    mq_waiter_t *w = NULL, *o = NULL;
+    int i = 0, n = 0;
+    bool overflow = false;
+
+    pthread_mutex_lock(&wa->wa_lock);
+    n = wa->wa_ninbox;
+    overflow = wa->wa_overflow;
+    memcpy(inbox, wa->wa_inbox, n * WAITER_QNAME_MAX_LEN);
+    wa->wa_ninbox = 0;
+    wa->wa_overflow = false;
+    pthread_mutex_unlock(&wa->wa_lock);
+
+    for (; i < n; i++)
+        waiter_wake(evt, inbox[i]);
+
+    if (!overflow)
+        return;
+
+    /*
+     * Some queues did not fit in; give the queue of every waiter a try.
+     * A wake may free any waiter of its queue, so start over each time.
+     */
+    for (w = wa->wa_waiters; NULL != w; w = w->wt_next)
+        w->wt_tried = false;
+    for (;;) {
+        for (w = wa->wa_waiters; NULL != w && w->wt_tried; w = w->wt_next)
+            ;
+        if (NULL == w)
+            break;
+        for (o = w; NULL != o; o = o->wt_next)
+            if (0 == strcmp(o->wt_qname, w->wt_qname))
+                o->wt_tried = true;
+        strcpy(inbox[0], w->wt_qname);
+        waiter_wake(evt, inbox[0]);
+    }
+}
+
+
+/**
+ * waiter_post()
+ *
+ * Hand 'qname' over to the worker 'evt' to wake its waiters on it. Called
+ * by the other workers.
+ *
+ *  evt        - worker to be woken
+ *  qname      - name of the queue
+ *
+ **/
+static void
+waiter_post(ev_thread_t *evt, const char *qname)
+{
+    mq_wait_t *wa = evt->evt_wait;
+    int i = 0;
+
+    pthread_mutex_lock(&wa->wa_lock);
+    for (; i < wa->wa_ninbox; i++)
+        if (0 == strcmp(wa->wa_inbox[i], qname))
+            break;
+    if (i == wa->wa_ninbox) {
+        if (WAITER_INBOX_LEN == wa->wa_ninbox)
+            wa->wa_overflow = true;
+        else
+            strcpy(wa->wa_inbox[wa->wa_ninbox++], qname);
+    }
+    pthread_mutex_unlock(&wa->wa_lock);
+
+    event_active(wa->wa_ev, EV_TIMEOUT, 0);
+}
+
+
+/**
+ * waiter_broadcast()
+ *
+ * Wake the waiters on 'qname' of all the workers
+ *
+ *  evt        - worker that is broadcasting
+ *  qname      - name of the queue
+ *
+ **/
+static void
+waiter_broadcast(ev_thread_t *evt, const char *qname)
+{
+    ev_thread_t *workers = NULL;
+    int i = 0, n = 0;
+
+    waiter_wake(evt, qname);
+
+    workers = thread_workers(&n);
+    for (; i < n; i++) {
+        if (&workers[i] == evt ||
+                0 == __atomic_load_n(&workers[i].evt_wait->wa_nwaiters,
+                                     __ATOMIC_SEQ_CST))
+            continue;
+        waiter_post(&workers[i], qname);
+    }
+}
+
+
+/**
+ * due_expired()
+ *
+ * Timer wheel callback; delayed messages have just become visible
+ *
+ *  arg        - due_t of the messages
+ *
+ **/
+static void
+due_expired(void *arg)
+{
+    due_t *du = (due_t *) arg;
+    due_t **pp = due_bucket(du->du_evt->evt_wait, du->du_qname, du->du_tick);
+
+    for (; NULL != *pp; pp = &(*pp)->du_next) {
+        if (*pp == du) {
+            *pp = du->du_next;
+            break;
+        }
+    }
+
+    waiter_broadcast(du->du_evt, du->du_qname);
+    free(du);
+}
+
+
+/**
+ * waiter_init()
+ *
+ * Set up the long poll state of the worker
+ *
+ *  evt        - worker
+ *  ev_base    - event base of the worker
+ *
+ **/
+mq_err_t
+waiter_init(ev_thread_t *evt, struct event_base *ev_base)
+{
+    mq_wait_t *wa = (mq_wait_t *)malloc(sizeof(mq_wait_t));
+    if (NULL == wa) {
+        mqerr("malloc failed for %zu bytes", sizeof(mq_wait_t));
+        return MQ_MALLOC_FAILED;
+    }
+
+    memset(wa, 0, sizeof(mq_wait_t));
+    if (0 != pthread_mutex_init(&wa->wa_lock, NULL)) {
+        mqerr("unable to initialize the waiter inbox lock");
+        free(wa);
+        return MQ_ERR;
+    }
+
+    wa->wa_ev = event_new(ev_base, -1, 0, waiter_inbox, evt);
+    if (NULL == wa->wa_ev) {
+        mqerr("unable to create the waiter inbox event");
+        pthread_mutex_destroy(&wa->wa_lock);
+        free(wa);
+        return MQ_EV_INIT_FAILED;
+    }
+
+    evt->evt_wait = wa;
+    return MQ_OK;
+}
+
+
+/**
+ * waiter_free()
+ *
+ * Tear down the long poll state of the worker, along with the pending
+ * delayed message timers. The waiters are normally gone by now, as
+ * evhttp_free() closes their connections; their requests are not touched.
+ *
+ *  evt        - worker
+ *
+ **/
+void
+waiter_free(ev_thread_t *evt)
+{
+    mq_wait_t *wa = evt->evt_wait;
+    mq_waiter_t *w = NULL;
+    due_t *du = NULL;
+    int i = 0;
+
+    while (NULL != (w = wa->wa_waiters)) {
+        wa->wa_waiters = w->wt_next;
+        tw_del(evt->evt_wheel, &w->wt_timer);
+        if (NULL != w->wt_watch)
+            event_free(w->wt_watch);
+        free(w);
+    }
+
+    for (; i < DUE_BUCKETS; i++) {
+        while (NULL != (du = wa->wa_dues[i])) {
+            wa->wa_dues[i] = du->du_next;
+            tw_del(evt->evt_wheel, &du->du_timer);
+            free(du);
+        }
+    }
+
+    event_free(wa->wa_ev);
+    pthread_mutex_destroy(&wa->wa_lock);
+    free(wa);
+    evt->evt_wait = NULL;
+}
+
+
+/**
+ * waiter_park()
+ *
+ * Park the pop 'req' on the worker until a message shows up in 'qname' or
+ * 'wait_ms' passes, whichever is earlier.
+ *
+ *  evt        - worker
+ *  req        - http event request structure of the pop
+ *  qname      - name of the queue
+ *  wait_ms    - max time to wait, in milli secs
+ *
+ **/
+mq_err_t
+waiter_park(ev_thread_t *evt, struct evhttp_request *req, const char *qname,
+            unsigned int wait_ms)
+{
+    mq_wait_t *wa = evt->evt_wait;
+    mq_waiter_t *w = NULL;
+    mq_waiter_t *tail = wa->wa_waiters;
+    struct evhttp_connection *evcon = evhttp_request_get_connection(req);
+    int nworkers = 0;
+
+    if (WAITER_QNAME_MAX_LEN <= strlen(qname)) {
+        mqerr("qname is too long: %s", qname);
+        return MQ_DB_QNAME_TOO_LONG;
+    }
+
+    w = (mq_waiter_t *)malloc(sizeof(mq_waiter_t));
+    if (NULL == w) {
+        mqerr("malloc failed for %zu bytes", sizeof(mq_waiter_t));
+        return MQ_MALLOC_FAILED;
+    }
+
+    memset(w, 0, sizeof(mq_waiter_t));
+    w->wt_evt = evt;
+    w->wt_req = req;
+    strcpy(w->wt_qname, qname);
+
+    /* append, so that the oldest waiter is woken first */
+    if (NULL == tail) {
+        wa->wa_waiters = w;
+    } else {
+        while (NULL != tail->wt_next)
+            tail = tail->wt_next;
+        tail->wt_next = w;
+        w->wt_prev = tail;
+    }
+    __sync_fetch_and_add(&wa->wa_nwaiters, 1);
+
+    tw_add(evt->evt_wheel, &w->wt_timer, wait_ms, waiter_timeout, w);
+    evhttp_connection_set_closecb(evcon, waiter_closed, w);
+
+    /* without it, a client that went away is noticed on the timeout only */
+    w->wt_watch = event_new(evt->evt_base,
+                            bufferevent_getfd(
+                                evhttp_connection_get_bufferevent(evcon)),
+                            EV_READ, waiter_watch, w);
+    if (NULL == w->wt_watch || 0 != event_add(w->wt_watch, NULL))
+        mqerr("unable to watch the waiter on %s", qname);
+    mqdbg("parked a pop on %s for %u ms", qname, wait_ms);
+
+    /*
+     * Another worker may have pushed after our pop but seen no waiters
+     * here, before they were counted; pop once more to not miss it.
+     */
+    thread_workers(&nworkers);
+    if (nworkers > 1)
+        waiter_wake(evt, qname);
+
+    return MQ_OK;
+}
+
+
+/**
+ * waiter_notify()
+ *
+ * A message was pushed into 'qname' by this worker. Wake the waiters of
+ * all the workers now, or when the message becomes visible if it was
+ * pushed with a delay.
+ *
+ *  evt        - worker
+ *  qname      - name of the queue
+ *  delay_ms   - delay the message was pushed with
+ *
+ **/
+void
+waiter_notify(ev_thread_t *evt, const char *qname, unsigned int delay_ms)
+{
+    uint64_t tick = 0;
+    due_t **bucket = NULL;
+    due_t *du = NULL;
+
+    if (0 == delay_ms) {
+        waiter_broadcast(evt, qname);
+        return;
+    }
+
+    if (WAITER_QNAME_MAX_LEN <= strlen(qname))
+        return;
+
+    /* messages of a queue due in the same tick share the timer */
+    tick = tw_ticks(evt->evt_wheel, delay_ms);
+    bucket = due_bucket(evt->evt_wait, qname, tick);
+    for (du = *bucket; NULL != du; du = du->du_next)
+        if (du->du_tick == tick && 0 == strcmp(du->du_qname, qname))
+            return;
+
+    du = (due_t *)malloc(sizeof(due_t));
+    if (NULL == du) {
+        /* waiters fall back on their timeout */
+        mqerr("malloc failed for %zu bytes", sizeof(due_t));
+        return;
+    }
+
+    memset(du, 0, sizeof(due_t));
+    du->du_evt = evt;
+    du->du_tick = tick;
+    strcpy(du->du_qname, qname);
+    du->du_next = *bucket;
+    *bucket = du;
+    tw_add(evt->evt_wheel, &du->du_timer, delay_ms, due_expired, du);
+}